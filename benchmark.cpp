@@ -0,0 +1,725 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HUFFMAN_BENCH_RDTSC 1
+#endif
+
+#include <unistd.h>
+
+#include "file_io.h"
+#include "huffman.h"
+
+// The codec as it was before the table-driven kernels, kept as the reference
+// point for the encode/decode throughput numbers.
+namespace baseline
+{
+    struct Node {
+        char symb;
+        uint64_t weight;
+        bool single;
+        std::unique_ptr<Node> left;
+        std::unique_ptr<Node> right;
+
+        Node(char symb, uint64_t weight, bool single = true,
+             std::unique_ptr<Node> left = nullptr, std::unique_ptr<Node> right = nullptr):
+                symb(symb), weight(weight), single(single), left(std::move(left)), right(std::move(right))
+        {}
+    };
+
+    const uint32_t buf_size = 1024 * 512;
+
+    std::unique_ptr<Node> build_tree(std::map<char, uint64_t>& freq)
+    {
+        std::multimap<uint64_t, std::unique_ptr<Node>> nodes;
+        for (auto& i : freq)
+            nodes.insert(std::make_pair(i.second, std::make_unique<Node>(i.first, i.second)));
+
+        while (nodes.size() > 1)
+        {
+            std::unique_ptr<Node> a = std::move(nodes.begin()->second);
+            nodes.erase(nodes.begin());
+            std::unique_ptr<Node> b = std::move(nodes.begin()->second);
+            nodes.erase(nodes.begin());
+
+            uint64_t w = a->weight + b->weight;
+            nodes.insert(std::make_pair(w, std::make_unique<Node>('0', w, false, std::move(a), std::move(b))));
+        }
+        return std::move(nodes.begin()->second);
+    }
+
+    void gen_codes(Node& v, std::array<std::vector<bool>, 256>& codes, std::vector<bool>& curr_code)
+    {
+        if (v.single)
+        {
+            codes[static_cast<unsigned char>(v.symb)] = curr_code;
+            curr_code.pop_back();
+            return;
+        }
+
+        curr_code.push_back(false);
+        gen_codes(*v.left, codes, curr_code);
+        curr_code.push_back(true);
+        gen_codes(*v.right, codes, curr_code);
+
+        if (!curr_code.empty())
+            curr_code.pop_back();
+    }
+
+    void encode(std::istream& fin, std::ostream& fout)
+    {
+        std::array<uint64_t, 256> freq_array = {};
+        std::vector<char> buffer(buf_size);
+        fout.write(&buffer[0], sizeof(char));
+
+        while (fin)
+        {
+            fin.read(buffer.data(), buf_size);
+            auto numb_of_symbs = size_t(fin.gcount());
+            for (size_t i = 0; i < numb_of_symbs; i++)
+                freq_array[static_cast<unsigned char>(buffer[i])]++;
+        }
+
+        std::map<char, uint64_t> freq;
+        freq['a'] = freq['b'] = 0;
+        for (uint32_t i = 0; i != 256; ++i)
+            if (freq_array[i] != 0)
+                freq[char(i)] = freq_array[i];
+
+        auto numb_of_symb = static_cast<uint16_t>(freq.size());
+        fout.write(reinterpret_cast<const char*>(&numb_of_symb), sizeof(numb_of_symb));
+        for (const auto i : freq)
+        {
+            char key = i.first;
+            uint64_t count = i.second;
+            fout.write(&key, sizeof(key));
+            fout.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        }
+
+        std::array<std::vector<bool>, 256> codes;
+        std::vector<bool> curr_code;
+        std::unique_ptr<Node> root = build_tree(freq);
+        gen_codes(*root, codes, curr_code);
+
+        char actual_code = 0;
+        char bits_counter = 0;
+        char numb_of_bits = 8;
+
+        fin.clear();
+        fin.seekg(0, std::ios::beg);
+
+        std::vector<char> buffer_out(buf_size);
+        size_t numb_of_codes = 0;
+
+        while (fin)
+        {
+            fin.read(buffer.data(), buf_size);
+            auto numb_of_symbs = size_t(fin.gcount());
+            for (size_t i = 0; i < numb_of_symbs; i++)
+            {
+                std::vector<bool> const& symb_code = codes[static_cast<unsigned char>(buffer[i])];
+                for (const auto next : symb_code)
+                {
+                    actual_code |= (next << bits_counter++);
+                    if (bits_counter == numb_of_bits)
+                    {
+                        buffer_out[numb_of_codes++] = actual_code;
+                        if (numb_of_codes == buf_size)
+                        {
+                            fout.write(buffer_out.data(), numb_of_codes);
+                            numb_of_codes = 0;
+                        }
+                        actual_code = 0;
+                        bits_counter = 0;
+                    }
+                }
+            }
+            fout.write(buffer_out.data(), numb_of_codes);
+            numb_of_codes = 0;
+        }
+
+        if (bits_counter)
+        {
+            bits_counter = numb_of_bits - bits_counter;
+            fout.write(&actual_code, sizeof(actual_code));
+        }
+        fout.seekp(0);
+        fout.write(&bits_counter, sizeof(bits_counter));
+    }
+
+    bool decode(std::istream& fin, std::ostream& fout)
+    {
+        char fake_zero;
+        fin.read(&fake_zero, sizeof(fake_zero));
+        if (!fin)
+            return false;
+
+        std::map<char, uint64_t> freq;
+        uint16_t numb_of_symb;
+        fin.read(reinterpret_cast<char*>(&numb_of_symb), sizeof(numb_of_symb));
+        for (size_t i = 0; i < numb_of_symb; i++)
+        {
+            char key;
+            uint64_t count;
+            fin.read(&key, sizeof(key));
+            if (!fin)
+                return false;
+            fin.read(reinterpret_cast<char*>(&count), sizeof(count));
+            if (freq.find(key) != freq.end())
+                return false;
+            freq[key] = count;
+        }
+
+        std::unique_ptr<Node> root = build_tree(freq);
+
+        std::vector<char> buffer(buf_size);
+        std::vector<char> buffer_out(buf_size);
+        size_t ready_chars = 0;
+        char numb_of_bits = 8;
+        Node* node = root.get();
+
+        while (fin)
+        {
+            ready_chars = 0;
+            fin.read(buffer.data(), buf_size);
+            auto symb_count = size_t(fin.gcount());
+            if (symb_count == 0)
+                break;
+            for (size_t i = 0; i < symb_count - 1; i++)
+            {
+                for (size_t j = 0; j < size_t(numb_of_bits); j++)
+                {
+                    node = (buffer[i] >> j) & 1 ? node->right.get() : node->left.get();
+                    if (!node)
+                        return false;
+
+                    if (node->single)
+                    {
+                        buffer_out[ready_chars++] = node->symb;
+                        if (ready_chars == buf_size)
+                        {
+                            ready_chars = 0;
+                            fout.write(buffer_out.data(), buf_size);
+                        }
+                        node = root.get();
+                    }
+                }
+            }
+            fout.write(buffer_out.data(), ready_chars);
+            if (!fin)
+                numb_of_bits = numb_of_bits - fake_zero;
+            for (size_t j = 0; j < size_t(numb_of_bits); j++)
+            {
+                node = (buffer[symb_count - 1] >> j) & 1 ? node->right.get() : node->left.get();
+                if (!node)
+                    return false;
+
+                if (node->single)
+                {
+                    fout.write(&node->symb, sizeof(char));
+                    node = root.get();
+                }
+            }
+        }
+        return true;
+    }
+}
+
+namespace
+{
+    struct result
+    {
+        double seconds;
+        double cycles;
+    };
+
+    // Best of several runs; the first run also warms up caches and the allocator.
+    result measure(std::function<void()> const& f, int reps = 3)
+    {
+        result best = {1e300, 1e300};
+        for (int i = 0; i < reps; i++)
+        {
+#ifdef HUFFMAN_BENCH_RDTSC
+            uint64_t c0 = __rdtsc();
+#endif
+            auto t0 = std::chrono::steady_clock::now();
+            f();
+            auto t1 = std::chrono::steady_clock::now();
+            double s = std::chrono::duration<double>(t1 - t0).count();
+            best.seconds = std::min(best.seconds, s);
+#ifdef HUFFMAN_BENCH_RDTSC
+            best.cycles = std::min(best.cycles, double(__rdtsc() - c0));
+#else
+            best.cycles = 0;
+#endif
+        }
+        return best;
+    }
+
+    void report(std::string const& name, size_t bytes, result r)
+    {
+        std::cout << std::left << std::setw(40) << name << std::right << std::fixed
+                  << std::setw(10) << std::setprecision(1) << bytes / r.seconds / 1e6 << " MB/s";
+        if (r.cycles > 0)
+            std::cout << std::setw(10) << std::setprecision(3) << bytes / r.cycles << " B/cycle";
+        std::cout << std::endl;
+    }
+
+    std::string random_bytes(size_t size)
+    {
+        std::mt19937 gen(42);
+        std::string s(size, '\0');
+        for (auto& c : s)
+            c = char(gen());
+        return s;
+    }
+
+    // Geometric-ish byte distribution, roughly as skewed as text or logs.
+    std::string skewed_bytes(size_t size)
+    {
+        std::mt19937 gen(7);
+        std::geometric_distribution<int> dist(0.08);
+        std::string s(size, '\0');
+        for (auto& c : s)
+            c = char('a' + std::min(dist(gen), 150));
+        return s;
+    }
+
+    std::string same_bytes(size_t size)
+    {
+        return std::string(size, 'a');
+    }
+
+    struct input
+    {
+        std::string name;
+        std::string data;
+    };
+
+    std::vector<input> inputs(size_t size)
+    {
+        return {{"random", random_bytes(size)},
+                {"skewed", skewed_bytes(size)},
+                {"same", same_bytes(size)}};
+    }
+
+    void bench_encode(std::vector<input> const& data)
+    {
+        std::cout << "== encode" << std::endl;
+        for (auto const& in : data)
+        {
+            report(in.name + " baseline", in.data.size(), measure([&] {
+                std::stringstream src(in.data), dst;
+                baseline::encode(src, dst);
+            }));
+            report(in.name + " table-driven", in.data.size(), measure([&] {
+                std::stringstream src(in.data), dst;
+                huffman::encode(src, dst);
+            }));
+            huffman::options opts;
+            std::vector<char> out(huffman::encode_bound(in.data.size(), opts));
+            report(in.name + " table-driven, buffer API", in.data.size(), measure([&] {
+                huffman::encode(in.data.data(), in.data.size(), out.data(), out.size(), opts);
+            }));
+        }
+    }
+
+    void bench_decode(std::vector<input> const& data)
+    {
+        std::cout << "== decode" << std::endl;
+        for (auto const& in : data)
+        {
+            std::stringstream src(in.data), legacy, current;
+            baseline::encode(src, legacy);
+            src.clear();
+            src.seekg(0);
+            huffman::encode(src, current);
+
+            report(in.name + " baseline", in.data.size(), measure([&] {
+                std::stringstream c(legacy.str()), dst;
+                baseline::decode(c, dst);
+            }));
+            report(in.name + " lookup table, legacy format", in.data.size(), measure([&] {
+                std::stringstream c(legacy.str()), dst;
+                huffman::decode(c, dst);
+            }));
+            report(in.name + " lookup table", in.data.size(), measure([&] {
+                std::stringstream c(current.str()), dst;
+                huffman::decode(c, dst);
+            }));
+            std::string encoded = current.str();
+            std::vector<char> out(in.data.size());
+            size_t written;
+            report(in.name + " lookup table, buffer API", in.data.size(), measure([&] {
+                huffman::decode(encoded.data(), encoded.size(), out.data(), out.size(), written, huffman::options());
+            }));
+        }
+    }
+
+    void bench_histogram(std::vector<input> const& data)
+    {
+        std::cout << "== histogram" << std::endl;
+        for (auto const& in : data)
+        {
+            std::array<uint64_t, 256> freq = {};
+            report(in.name + " byte loop", in.data.size(), measure([&] {
+                for (char c : in.data)
+                    freq[static_cast<unsigned char>(c)]++;
+            }));
+            report(in.name + " sub-histograms", in.data.size(), measure([&] {
+                huffman::histogram(in.data.data(), in.data.size(), freq);
+            }));
+            report(in.name + " sub-histograms, 4 threads", in.data.size(), measure([&] {
+                huffman::histogram(in.data.data(), in.data.size(), freq, 4);
+            }));
+            // Keeps the counts observable so the loops aren't dropped.
+            if (freq[0] == 1)
+                std::cout << "";
+        }
+    }
+
+    void bench_streams(std::vector<input> const& data)
+    {
+        std::cout << "== interleaved streams (decode, one thread)" << std::endl;
+        for (auto const& in : data)
+        {
+            for (unsigned streams : {1, 2, 4, 8})
+            {
+                huffman::options opts;
+                opts.streams = streams;
+                std::stringstream src(in.data), encoded;
+                huffman::encode(src, encoded, opts);
+                report(in.name + " " + std::to_string(streams) + " stream(s)", in.data.size(), measure([&] {
+                    std::stringstream c(encoded.str()), dst;
+                    huffman::decode(c, dst);
+                }));
+            }
+        }
+    }
+
+    void bench_adaptive(std::vector<input> const& data)
+    {
+        std::cout << "== adaptive (FGK) vs static, buffer API" << std::endl;
+        for (auto const& in : data)
+        {
+            for (bool adaptive : {false, true})
+            {
+                huffman::options opts;
+                opts.adaptive = adaptive;
+                std::string name = in.name + (adaptive ? " adaptive" : " static");
+                std::vector<char> encoded(huffman::encode_bound(in.data.size(), opts));
+                size_t size = 0;
+                report(name + " encode", in.data.size(), measure([&] {
+                    size = huffman::encode(in.data.data(), in.data.size(), encoded.data(), encoded.size(), opts);
+                }));
+                std::vector<char> out(in.data.size());
+                size_t written;
+                report(name + " decode", in.data.size(), measure([&] {
+                    huffman::decode(encoded.data(), size, out.data(), out.size(), written, opts);
+                }));
+                std::cout << std::left << std::setw(40) << name + " ratio" << std::right << std::fixed
+                          << std::setw(10) << std::setprecision(4) << double(size) / in.data.size() << std::endl;
+            }
+        }
+    }
+
+    // Words drawn from a small vocabulary, so each byte says a lot about the
+    // next one, as in text and logs.
+    std::string word_bytes(size_t size)
+    {
+        std::mt19937 gen(11);
+        std::vector<std::string> words;
+        for (int i = 0; i < 300; i++)
+        {
+            std::string w(2 + gen() % 8, ' ');
+            for (auto& c : w)
+                c = char('a' + gen() % 26);
+            words.push_back(w);
+        }
+        std::geometric_distribution<int> dist(0.02);
+        std::string s;
+        while (s.size() < size)
+            s += words[std::min(dist(gen), 299)] + (gen() % 12 ? " " : ".\n");
+        s.resize(size);
+        return s;
+    }
+
+    void bench_order1(std::vector<input> data)
+    {
+        std::cout << "== order-1 contexts vs order-0, buffer API" << std::endl;
+        data.push_back({"words", word_bytes(data.front().data.size())});
+        for (auto const& in : data)
+        {
+            for (bool order1 : {false, true})
+            {
+                huffman::options opts;
+                opts.order1 = order1;
+                std::string name = in.name + (order1 ? " order-1" : " order-0");
+                std::vector<char> encoded(huffman::encode_bound(in.data.size(), opts));
+                size_t size = 0;
+                report(name + " encode", in.data.size(), measure([&] {
+                    size = huffman::encode(in.data.data(), in.data.size(), encoded.data(), encoded.size(), opts);
+                }));
+                std::vector<char> out(in.data.size());
+                size_t written;
+                report(name + " decode", in.data.size(), measure([&] {
+                    huffman::decode(encoded.data(), size, out.data(), out.size(), written, opts);
+                }));
+                std::cout << std::left << std::setw(40) << name + " ratio" << std::right << std::fixed
+                          << std::setw(10) << std::setprecision(4) << double(size) / in.data.size() << std::endl;
+            }
+        }
+    }
+
+    // The checksum alone, then the framed format with and without block
+    // checksums, where they should cost a few percent at most.
+    void bench_checksum(std::vector<input> const& data)
+    {
+        std::cout << "== CRC-32C block checksums, buffer API" << std::endl;
+        for (auto const& in : data)
+        {
+            uint32_t crc = 0;
+            report(in.name + " crc32c", in.data.size(), measure([&] {
+                crc = huffman::crc32c(in.data.data(), in.data.size());
+            }));
+
+            result plain[2] = {};
+            for (bool checksums : {false, true})
+            {
+                huffman::options opts;
+                opts.checksums = checksums;
+                std::string name = in.name + (checksums ? " checked" : " unchecked");
+                std::vector<char> encoded(huffman::encode_bound(in.data.size(), opts));
+                size_t size = 0;
+                result enc = measure([&] {
+                    size = huffman::encode(in.data.data(), in.data.size(), encoded.data(), encoded.size(), opts);
+                }, 9);
+                std::vector<char> out(in.data.size());
+                size_t written;
+                result dec = measure([&] {
+                    huffman::decode(encoded.data(), size, out.data(), out.size(), written, opts);
+                }, 9);
+                report(name + " encode", in.data.size(), enc);
+                report(name + " decode", in.data.size(), dec);
+                if (!checksums)
+                {
+                    plain[0] = enc;
+                    plain[1] = dec;
+                    continue;
+                }
+                std::cout << std::left << std::setw(40) << in.name + " overhead encode / decode" << std::right
+                          << std::fixed << std::setprecision(2) << std::setw(9)
+                          << 100.0 * (enc.seconds / plain[0].seconds - 1) << " %" << std::setw(9)
+                          << 100.0 * (dec.seconds / plain[1].seconds - 1) << " %" << std::endl;
+            }
+        }
+    }
+
+    // Many 1 KB messages, each coded on its own, as an RPC layer would.
+    void bench_context(std::vector<input> const& data)
+    {
+        std::cout << "== 1 KB messages, static calls vs reused encoder/decoder" << std::endl;
+        const size_t message = 1024;
+        for (auto const& in : data)
+        {
+            size_t count = std::min<size_t>(in.data.size() / message, 4096);
+            huffman::options opts;
+            std::vector<char> encoded(huffman::encode_bound(message, opts));
+            std::vector<char> out(message);
+            size_t size = 0;
+            size_t written;
+            report(in.name + " static encode", count * message, measure([&] {
+                for (size_t i = 0; i < count; i++)
+                    size = huffman::encode(in.data.data() + i * message, message, encoded.data(), encoded.size(), opts);
+            }));
+            report(in.name + " static decode", count * message, measure([&] {
+                for (size_t i = 0; i < count; i++)
+                    huffman::decode(encoded.data(), size, out.data(), out.size(), written, opts);
+            }));
+
+            huffman::encoder encoder(opts);
+            huffman::decoder decoder(opts);
+            report(in.name + " encoder object", count * message, measure([&] {
+                for (size_t i = 0; i < count; i++)
+                    size = encoder.encode(in.data.data() + i * message, message, encoded.data(), encoded.size());
+            }));
+            report(in.name + " decoder object", count * message, measure([&] {
+                for (size_t i = 0; i < count; i++)
+                    decoder.decode(encoded.data(), size, out.data(), out.size(), written);
+            }));
+        }
+    }
+
+    enum class backend { streams, mapped, async };
+
+    void code_file(backend b, bool encode, std::string const& src, std::string const& dst)
+    {
+        huffman::options opts;
+        if (b == backend::mapped)
+        {
+            mapped_file in;
+            in.open(src);
+            if (encode)
+            {
+                std::ofstream out(dst, std::ofstream::binary);
+                huffman::encode(in.data(), in.size(), out, opts);
+                return;
+            }
+            uint64_t raw = 0;
+            huffman::decoded_size(in.data(), in.size(), raw);
+            mapped_file out;
+            out.create(dst, size_t(raw));
+            size_t written;
+            huffman::decode(in.data(), in.size(), out.data(), out.size(), written, opts);
+        }
+        else if (b == backend::async)
+        {
+            async_input in;
+            async_output out;
+            in.open(src);
+            out.open(dst);
+            std::istream istrm(&in);
+            std::ostream ostrm(&out);
+            if (encode)
+                huffman::encode(istrm, ostrm, opts);
+            else
+                huffman::decode(istrm, ostrm, opts);
+        }
+        else
+        {
+            std::ifstream in(src, std::ifstream::binary);
+            std::ofstream out(dst, std::ofstream::binary);
+            if (encode)
+                huffman::encode(in, out, opts);
+            else
+                huffman::decode(in, out, opts);
+        }
+    }
+
+    // Files go through the page cache, so this measures the cost of the
+    // I/O path itself (copies, syscalls, waits) rather than the storage.
+    void bench_io(std::vector<input> const& data)
+    {
+        std::cout << "== file I/O (encode + decode, one file at a time)" << std::endl;
+        char dir[] = "/tmp/huffman_bench_XXXXXX";
+        if (!mkdtemp(dir))
+            return;
+        std::string const& text = data[1].data;
+
+        for (size_t files : {1, 256})
+        {
+            std::vector<std::string> names;
+            size_t part = text.size() / files;
+            for (size_t i = 0; i < files; i++)
+            {
+                names.push_back(std::string(dir) + "/" + std::to_string(i));
+                std::ofstream(names.back(), std::ofstream::binary).write(text.data() + i * part, part);
+            }
+
+            std::string cases = files == 1 ? "one file" : std::to_string(files) + " files";
+            std::pair<backend, std::string> backends[] = {{backend::streams, "streams"},
+                                                          {backend::mapped, "mmap"},
+                                                          {backend::async, "io_uring"}};
+            for (auto const& b : backends)
+            {
+                report(cases + ", " + b.second, part * files, measure([&] {
+                    for (auto const& name : names)
+                    {
+                        code_file(b.first, true, name, name + ".huf");
+                        code_file(b.first, false, name + ".huf", name + ".out");
+                    }
+                }));
+            }
+            for (auto const& name : names)
+            {
+                std::remove(name.c_str());
+                std::remove((name + ".huf").c_str());
+                std::remove((name + ".out").c_str());
+            }
+        }
+        rmdir(dir);
+    }
+
+    // Geometric with a steep tail so that unlimited codes get long.
+    std::string steep_bytes(size_t size)
+    {
+        std::mt19937 gen(11);
+        std::geometric_distribution<int> dist(0.45);
+        std::string s(size, '\0');
+        for (auto& c : s)
+            c = char(std::min(dist(gen), 255));
+        return s;
+    }
+
+    void bench_length_limit(std::vector<input> data)
+    {
+        std::cout << "== code length limit (compressed size, cost vs unlimited)" << std::endl;
+        data.push_back({"steep", steep_bytes(data.front().data.size())});
+        for (auto const& in : data)
+        {
+            size_t unlimited = 0;
+            for (uint8_t limit : {0, 15, 12, 11})
+            {
+                huffman::options opts;
+                opts.max_code_length = limit;
+                std::stringstream src(in.data), dst;
+                huffman::encode(src, dst, opts);
+                size_t size = dst.str().size();
+                if (!limit)
+                    unlimited = size;
+                std::cout << std::left << std::setw(40)
+                          << in.name + " max " + (limit ? std::to_string(limit) : std::string("unlimited"))
+                          << std::right << std::setw(12) << size << std::fixed << std::setprecision(3)
+                          << std::setw(9) << 100.0 * (double(size) / unlimited - 1) << " %" << std::endl;
+            }
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    size_t size = 32 << 20;
+    std::string filter;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-s" && i + 1 < argc)
+            size = size_t(std::stoull(argv[++i])) << 20;
+        else
+            filter = arg;
+    }
+
+    std::vector<input> data = inputs(size);
+    if (filter.empty() || filter == "limit")
+        bench_length_limit(data);
+    if (filter.empty() || filter == "encode")
+        bench_encode(data);
+    if (filter.empty() || filter == "decode")
+        bench_decode(data);
+    if (filter.empty() || filter == "histogram")
+        bench_histogram(data);
+    if (filter.empty() || filter == "adaptive")
+        bench_adaptive(data);
+    if (filter.empty() || filter == "order1")
+        bench_order1(data);
+    if (filter.empty() || filter == "context")
+        bench_context(data);
+    if (filter.empty() || filter == "checksum")
+        bench_checksum(data);
+    if (filter.empty() || filter == "io")
+        bench_io(data);
+    if (filter.empty() || filter == "streams")
+        bench_streams(data);
+}
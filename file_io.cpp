@@ -0,0 +1,493 @@
+#include "file_io.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HUFFMAN_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+mapped_file::~mapped_file()
+{
+    if (base)
+        munmap(base, length);
+    if (fd >= 0)
+        close(fd);
+}
+
+bool mapped_file::open(std::string const& path)
+{
+    fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return false;
+    length = size_t(st.st_size);
+    if (!map(PROT_READ))
+        return false;
+    madvise(base, length, MADV_SEQUENTIAL);
+    return true;
+}
+
+bool mapped_file::create(std::string const& path, size_t size)
+{
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return false;
+    length = size;
+    if (!size)
+        return true;
+#ifdef __linux__
+    // Reserving the blocks keeps page faults on the output from allocating
+    // one extent at a time; not every file system supports it.
+    if (posix_fallocate(fd, 0, off_t(size)) != 0 && ftruncate(fd, off_t(size)) != 0)
+        return false;
+#else
+    if (ftruncate(fd, off_t(size)) != 0)
+        return false;
+#endif
+    return map(PROT_READ | PROT_WRITE);
+}
+
+bool mapped_file::map(int prot)
+{
+    void* p = mmap(nullptr, length, prot, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return false;
+    base = static_cast<char*>(p);
+    return true;
+}
+
+io_queue::io_queue(unsigned depth)
+{
+#ifdef HUFFMAN_IO_URING
+    io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    int fd = int(syscall(__NR_io_uring_setup, depth, &p));
+    if (fd < 0)
+        return;
+
+    // Rings and entries are mapped separately so that kernels without
+    // IORING_FEAT_SINGLE_MMAP work too.
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        for (void* m : {sq_ring, cq_ring, sqes})
+            if (m != MAP_FAILED)
+                munmap(m, m == sq_ring ? sq_ring_size : m == cq_ring ? cq_ring_size : sqes_size);
+        sq_ring = cq_ring = sqes = nullptr;
+        close(fd);
+        return;
+    }
+
+    char* sq = static_cast<char*>(sq_ring);
+    char* cq = static_cast<char*>(cq_ring);
+    sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes = cq + p.cq_off.cqes;
+    ring_fd = fd;
+#else
+    (void)depth;
+#endif
+}
+
+io_queue::~io_queue()
+{
+    if (ring_fd < 0)
+        return;
+    munmap(sq_ring, sq_ring_size);
+    munmap(cq_ring, cq_ring_size);
+    munmap(sqes, sqes_size);
+    close(ring_fd);
+}
+
+void io_queue::read(int fd, char* buf, size_t size, uint64_t offset, uint64_t tag)
+{
+    submit(false, fd, buf, size, offset, tag);
+}
+
+void io_queue::write(int fd, const char* buf, size_t size, uint64_t offset, uint64_t tag)
+{
+    submit(true, fd, buf, size, offset, tag);
+}
+
+void io_queue::submit(bool write, int fd, const char* buf, size_t size, uint64_t offset, uint64_t tag)
+{
+#ifdef HUFFMAN_IO_URING
+    if (ring_fd >= 0)
+    {
+        // Only this thread moves the tail, so a plain load of it is enough.
+        unsigned tail = *sq_tail;
+        unsigned index = tail & *sq_mask;
+        io_uring_sqe& sqe = static_cast<io_uring_sqe*>(sqes)[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = uint64_t(reinterpret_cast<uintptr_t>(buf));
+        sqe.len = unsigned(size);
+        sqe.off = offset;
+        sqe.user_data = tag;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        long r;
+        do
+            r = syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0);
+        while (r < 0 && errno == EINTR);
+        if (r == 1)
+            return;
+        // The kernel didn't take the entry. Nothing else moves the tail (one
+        // thread, no SQPOLL), so it is taken back, or the next submit would
+        // hand the kernel this entry instead of its own; the request then
+        // runs synchronously below.
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+    }
+#endif
+    ssize_t r = write ? pwrite(fd, buf, size, off_t(offset)) : pread(fd, const_cast<char*>(buf), size, off_t(offset));
+    done.push_back({tag, r < 0 ? -long(errno) : long(r)});
+}
+
+void io_queue::wait(uint64_t& tag, long& result)
+{
+    if (!done.empty())
+    {
+        tag = done.front().tag;
+        result = done.front().result;
+        done.pop_front();
+        return;
+    }
+#ifdef HUFFMAN_IO_URING
+    while (ring_fd >= 0)
+    {
+        unsigned head = *cq_head;
+        if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        {
+            io_uring_cqe const& cqe = static_cast<io_uring_cqe*>(cqes)[head & *cq_mask];
+            tag = cqe.user_data;
+            result = cqe.res;
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            return;
+        }
+        syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+    }
+#endif
+    tag = 0;
+    result = -EINVAL;
+}
+
+async_input::async_input(unsigned depth, size_t chunk):
+        queue(depth),
+        buffers(depth),
+        sizes(depth, 0),
+        results(depth, 0),
+        pending(depth, false),
+        chunk(chunk)
+{}
+
+async_input::~async_input()
+{
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        while (pending[i])
+            reap();
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
+bool async_input::open(std::string const& path)
+{
+    fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+    file_size = uint64_t(st.st_size);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    for (size_t slot = 0; slot < buffers.size(); slot++)
+        issue(slot);
+    return true;
+}
+
+void async_input::issue(size_t slot)
+{
+    sizes[slot] = size_t(std::min<uint64_t>(chunk, file_size - next_offset));
+    results[slot] = 0;
+    if (!sizes[slot])
+        return;
+    // Buffers are allocated on first use, so small files cost little.
+    if (buffers[slot].size() < sizes[slot])
+        buffers[slot].resize(chunk);
+    queue.read(fd, buffers[slot].data(), sizes[slot], next_offset, slot);
+    pending[slot] = true;
+    next_offset += sizes[slot];
+}
+
+void async_input::reap()
+{
+    uint64_t tag;
+    long result;
+    queue.wait(tag, result);
+    if (tag >= pending.size())
+    {
+        error = true;
+        std::fill(pending.begin(), pending.end(), false);
+        return;
+    }
+    pending[tag] = false;
+    results[tag] = result;
+}
+
+async_input::int_type async_input::underflow()
+{
+    if (gptr() < egptr())
+        return traits_type::to_int_type(*gptr());
+    if (fd < 0 || error)
+        return traits_type::eof();
+
+    // The chunk just consumed is reused for the read furthest ahead.
+    if (eback())
+    {
+        issue(current);
+        current = (current + 1) % buffers.size();
+    }
+    while (pending[current] && !error)
+        reap();
+
+    // Reads of a regular file come back short only at its end, which the
+    // chunk sizes already account for.
+    if (error || results[current] != long(sizes[current]))
+    {
+        error = true;
+        return traits_type::eof();
+    }
+    if (!sizes[current])
+        return traits_type::eof();
+    char* base = buffers[current].data();
+    setg(base, base, base + sizes[current]);
+    return traits_type::to_int_type(*gptr());
+}
+
+async_output::async_output(unsigned depth, size_t chunk):
+        queue(depth),
+        buffers(depth),
+        chunk(chunk),
+        pending(depth, false),
+        sizes(depth, 0),
+        offsets(depth, 0)
+{}
+
+async_output::~async_output()
+{
+    close();
+}
+
+bool async_output::open(std::string const& path)
+{
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return false;
+    setp(nullptr, nullptr);
+    return true;
+}
+
+bool async_output::close()
+{
+    if (fd < 0)
+        return !error;
+    sync();
+    ::close(fd);
+    fd = -1;
+    setp(nullptr, nullptr);
+    return !error;
+}
+
+async_output::int_type async_output::overflow(int_type c)
+{
+    if (fd < 0)
+        return traits_type::eof();
+    issue();
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+    {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+int async_output::sync()
+{
+    if (fd < 0)
+        return 0;
+    issue();
+    while (in_flight)
+        reap();
+    return error ? -1 : 0;
+}
+
+// Queues the filled part of the current chunk and moves on to the next one,
+// waiting only if that one is still being written.
+void async_output::issue()
+{
+    auto size = size_t(pptr() - pbase());
+    if (size)
+    {
+        queue.write(fd, pbase(), size, offset, current);
+        pending[current] = true;
+        sizes[current] = size;
+        offsets[current] = offset;
+        offset += size;
+        in_flight++;
+        current = (current + 1) % buffers.size();
+        while (pending[current])
+            reap();
+    }
+    // Chunks are allocated on first use and grow from a small first one,
+    // so small outputs cost little.
+    std::vector<char>& buffer = buffers[current];
+    if (buffer.size() < chunk)
+        buffer.resize(std::min(chunk, std::max<size_t>(buffer.size() * 4, 1 << 16)));
+    setp(buffer.data(), buffer.data() + buffer.size());
+}
+
+void async_output::reap()
+{
+    uint64_t tag;
+    long result;
+    queue.wait(tag, result);
+    if (tag >= pending.size())
+    {
+        error = true;
+        in_flight = 0;
+        std::fill(pending.begin(), pending.end(), false);
+        return;
+    }
+    pending[tag] = false;
+    in_flight--;
+
+    // A short write is finished synchronously; it is rare enough not to
+    // be worth another round trip through the queue.
+    size_t written = result < 0 ? 0 : size_t(result);
+    while (result >= 0 && written < sizes[tag])
+    {
+        ssize_t r = pwrite(fd, buffers[tag].data() + written, sizes[tag] - written, off_t(offsets[tag] + written));
+        if (r <= 0)
+            break;
+        written += size_t(r);
+    }
+    if (written != sizes[tag])
+        error = true;
+}
+
+#else
+
+mapped_file::~mapped_file() = default;
+
+bool mapped_file::open(std::string const&)
+{
+    return false;
+}
+
+bool mapped_file::create(std::string const&, size_t)
+{
+    return false;
+}
+
+bool mapped_file::map(int)
+{
+    return false;
+}
+
+io_queue::io_queue(unsigned)
+{}
+
+io_queue::~io_queue() = default;
+
+void io_queue::read(int, char*, size_t, uint64_t, uint64_t)
+{}
+
+void io_queue::write(int, const char*, size_t, uint64_t, uint64_t)
+{}
+
+void io_queue::submit(bool, int, const char*, size_t, uint64_t, uint64_t)
+{}
+
+void io_queue::wait(uint64_t& tag, long& result)
+{
+    tag = 0;
+    result = -1;
+}
+
+async_input::async_input(unsigned depth, size_t chunk):
+        queue(depth),
+        chunk(chunk)
+{}
+
+async_input::~async_input() = default;
+
+bool async_input::open(std::string const&)
+{
+    return false;
+}
+
+void async_input::issue(size_t)
+{}
+
+void async_input::reap()
+{}
+
+async_input::int_type async_input::underflow()
+{
+    return traits_type::eof();
+}
+
+async_output::async_output(unsigned depth, size_t chunk):
+        queue(depth),
+        chunk(chunk)
+{}
+
+async_output::~async_output() = default;
+
+bool async_output::open(std::string const&)
+{
+    return false;
+}
+
+bool async_output::close()
+{
+    return false;
+}
+
+async_output::int_type async_output::overflow(int_type)
+{
+    return traits_type::eof();
+}
+
+int async_output::sync()
+{
+    return -1;
+}
+
+void async_output::issue()
+{}
+
+void async_output::reap()
+{}
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef HUFFMAN_V2_FILE_IO_H
+#define HUFFMAN_V2_FILE_IO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+// Whole-file memory mapping for the command-line tool. Both calls return
+// false when the file can't be mapped, such as a pipe or a device, and the
+// caller falls back to streams.
+class mapped_file {
+public:
+    mapped_file() = default;
+    ~mapped_file();
+
+    mapped_file(mapped_file const&) = delete;
+    mapped_file& operator=(mapped_file const&) = delete;
+
+    // Maps an existing regular file read-only with a sequential access hint.
+    bool open(std::string const& path);
+    // Creates or truncates a file of exactly `size` bytes, reserving its
+    // blocks up front, and maps it writable.
+    bool create(std::string const& path, size_t size);
+
+    char* data() const { return base; }
+    size_t size() const { return length; }
+
+private:
+    bool map(int prot);
+
+    int fd = -1;
+    char* base = nullptr;
+    size_t length = 0;
+};
+
+// Positioned reads and writes kept in flight on an io_uring. Where the build
+// or the kernel lacks io_uring, each request runs at once with pread/pwrite
+// and only its completion is deferred.
+class io_queue {
+public:
+    explicit io_queue(unsigned depth);
+    ~io_queue();
+
+    io_queue(io_queue const&) = delete;
+    io_queue& operator=(io_queue const&) = delete;
+
+    bool uring() const { return ring_fd >= 0; }
+
+    // At most `depth` requests may be outstanding; `tag` comes back from wait.
+    void read(int fd, char* buf, size_t size, uint64_t offset, uint64_t tag);
+    void write(int fd, const char* buf, size_t size, uint64_t offset, uint64_t tag);
+    // Blocks for the next completion: bytes transferred or -errno.
+    void wait(uint64_t& tag, long& result);
+
+private:
+    void submit(bool write, int fd, const char* buf, size_t size, uint64_t offset, uint64_t tag);
+
+    struct completion
+    {
+        uint64_t tag;
+        long result;
+    };
+
+    int ring_fd = -1;
+    void* sq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    void* cq_ring = nullptr;
+    size_t cq_ring_size = 0;
+    void* sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    void* cqes = nullptr;
+    std::deque<completion> done;
+};
+
+// Input buffer over a regular file that keeps `depth` chunk reads in flight
+// ahead of the consumer, so the codec never waits on a read it could have
+// issued earlier. Not seekable, which steers encode to the framed format.
+class async_input : public std::streambuf {
+public:
+    explicit async_input(unsigned depth = 4, size_t chunk = size_t(1) << 20);
+    ~async_input() override;
+
+    bool open(std::string const& path);
+    bool failed() const { return error; }
+
+protected:
+    int_type underflow() override;
+
+private:
+    void issue(size_t slot);
+    void reap();
+
+    io_queue queue;
+    std::vector<std::vector<char>> buffers;
+    std::vector<size_t> sizes;
+    std::vector<long> results;
+    std::vector<bool> pending;
+    size_t chunk;
+    size_t current = 0;
+    uint64_t next_offset = 0;
+    uint64_t file_size = 0;
+    int fd = -1;
+    bool error = false;
+};
+
+// Output buffer that hands each full chunk to the queue and keeps filling the
+// next one, waiting only when all `depth` chunks are still being written.
+class async_output : public std::streambuf {
+public:
+    explicit async_output(unsigned depth = 4, size_t chunk = size_t(1) << 20);
+    ~async_output() override;
+
+    bool open(std::string const& path);
+    // Flushes and waits for every write; false if any of them failed.
+    bool close();
+
+protected:
+    int_type overflow(int_type c) override;
+    int sync() override;
+
+private:
+    void issue();
+    void reap();
+
+    io_queue queue;
+    std::vector<std::vector<char>> buffers;
+    size_t chunk;
+    std::vector<bool> pending;
+    std::vector<size_t> sizes;
+    std::vector<uint64_t> offsets;
+    size_t current = 0;
+    size_t in_flight = 0;
+    uint64_t offset = 0;
+    int fd = -1;
+    bool error = false;
+};
+
+
+#endif //HUFFMAN_V2_FILE_IO_H
@@ -2,234 +2,3448 @@
 // Created by andry on 27.09.2018.
 //
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <fstream>
+#include <limits>
 #include <set>
 #include <unordered_map>
 #include "huffman.h"
+#include "thread_pool.h"
 
-struct huffman::Node
-        : public std::initializer_list<::huffman::Node> {
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HUFFMAN_CRC_SSE42
+#endif
+
+namespace
+{
+    inline void store_le64(char* dst, uint64_t word)
+    {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        std::memcpy(dst, &word, sizeof(word));
+#else
+        for (size_t i = 0; i < sizeof(word); i++)
+            dst[i] = static_cast<char>(word >> (8 * i));
+#endif
+    }
+
+    inline uint64_t load_le64(const char* src)
+    {
+        uint64_t word = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        std::memcpy(&word, src, sizeof(word));
+#else
+        for (size_t i = 0; i < sizeof(word); i++)
+            word |= uint64_t(static_cast<unsigned char>(src[i])) << (8 * i);
+#endif
+        return word;
+    }
+
+    inline uint64_t load_le(const char* src, size_t size)
+    {
+        uint64_t value = 0;
+        for (size_t i = 0; i < size; i++)
+            value |= uint64_t(static_cast<unsigned char>(src[i])) << (8 * i);
+        return value;
+    }
+
+    inline char* put_varint(char* out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            *out++ = char(value | 0x80);
+            value >>= 7;
+        }
+        *out++ = char(value);
+        return out;
+    }
+
+    inline bool read_varint(std::istream& fin, uint64_t& value)
+    {
+        value = 0;
+        for (uint8_t shift = 0; shift < 64; shift += 7)
+        {
+            char byte;
+            if (!fin.get(byte))
+                return false;
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    inline bool get_varint(const char*& p, const char* end, uint64_t& value)
+    {
+        value = 0;
+        for (uint8_t shift = 0; p != end && shift < 64; shift += 7)
+        {
+            auto byte = static_cast<unsigned char>(*p++);
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    // Adds the counts of one slice to its part.
+    struct count_task : thread_pool::task
+    {
+        void run() override
+        {
+            huffman::histogram(data, size, *part);
+        }
+
+        const char* data;
+        size_t size;
+        std::array<uint64_t, 256>* part;
+    };
+
+    // Counts one slice of [data, data + size) into each part on the pool.
+    void count_slices(thread_pool& pool, const char* data, size_t size,
+                      std::vector<std::array<uint64_t, 256>>& parts, std::vector<count_task>& tasks)
+    {
+        size_t slice = (size + parts.size() - 1) / parts.size();
+        tasks.resize(parts.size());
+        for (size_t t = 0; t < parts.size() && t * slice < size; t++)
+        {
+            tasks[t].data = data + t * slice;
+            tasks[t].size = std::min(slice, size - t * slice);
+            tasks[t].part = &parts[t];
+            pool.submit(tasks[t]);
+        }
+    }
+
+    // Adds the counts of [data, data + size) to freq, a slice per thread.
+    void count_parallel(thread_pool& pool, unsigned threads, const char* data, size_t size,
+                        std::array<uint64_t, 256>& freq, std::vector<std::array<uint64_t, 256>>& parts,
+                        std::vector<count_task>& tasks)
+    {
+        parts.assign(threads, std::array<uint64_t, 256>());
+        count_slices(pool, data, size, parts, tasks);
+        for (auto& t : tasks)
+            t.wait();
+        for (auto const& part : parts)
+            for (uint32_t i = 0; i != 256; ++i)
+                freq[i] += part[i];
+    }
+
+    // CRC-32C (Castagnoli) register updates, without the inversion before
+    // and after. Slicing by 8: table[k][b] is the register after byte b is
+    // followed by k zero bytes.
+    struct crc_tables
+    {
+        crc_tables()
+        {
+            for (uint32_t b = 0; b != 256; ++b)
+            {
+                uint32_t crc = b;
+                for (int bit = 0; bit < 8; bit++)
+                    crc = crc >> 1 ^ (crc & 1 ? 0x82f63b78 : 0);
+                table[0][b] = crc;
+            }
+            for (uint32_t b = 0; b != 256; ++b)
+                for (size_t k = 1; k < 8; k++)
+                    table[k][b] = table[k - 1][b] >> 8 ^ table[0][table[k - 1][b] & 0xff];
+        }
+
+        uint32_t table[8][256];
+    };
+
+    uint32_t crc_soft(uint32_t crc, const char* p, size_t size)
+    {
+        static const crc_tables tables;
+        auto const& t = tables.table;
+        for (; size >= 8; p += 8, size -= 8)
+        {
+            uint64_t word = load_le64(p) ^ crc;
+            crc = t[7][word & 0xff] ^ t[6][word >> 8 & 0xff] ^ t[5][word >> 16 & 0xff] ^ t[4][word >> 24 & 0xff]
+                    ^ t[3][word >> 32 & 0xff] ^ t[2][word >> 40 & 0xff] ^ t[1][word >> 48 & 0xff] ^ t[0][word >> 56];
+        }
+        for (; size; size--)
+            crc = crc >> 8 ^ t[0][(crc ^ static_cast<unsigned char>(*p++)) & 0xff];
+        return crc;
+    }
+
+#ifdef HUFFMAN_CRC_SSE42
+    // The crc32 instruction has a latency of three cycles and a throughput of
+    // one, so three lanes of crc_lane bytes are run side by side and then
+    // joined: the register of the earlier lane is moved past the later one
+    // by multiplying with x^(8 * crc_lane), a linear map kept as four tables.
+    const size_t crc_lane = 2048;
+
+    struct crc_shift
+    {
+        crc_shift()
+        {
+            std::vector<char> zeros(crc_lane);
+            for (uint32_t k = 0; k != 4; ++k)
+                for (uint32_t b = 0; b != 256; ++b)
+                    table[k][b] = crc_soft(b << (8 * k), zeros.data(), zeros.size());
+        }
+
+        uint32_t operator()(uint32_t crc) const
+        {
+            return table[0][crc & 0xff] ^ table[1][crc >> 8 & 0xff] ^ table[2][crc >> 16 & 0xff]
+                    ^ table[3][crc >> 24];
+        }
+
+        uint32_t table[4][256];
+    };
+
+    __attribute__((target("sse4.2")))
+    uint32_t crc_sse42(uint32_t crc, const char* p, size_t size)
+    {
+        static const crc_shift shift;
+        uint64_t c0 = crc;
+        for (; size >= 3 * crc_lane; p += 3 * crc_lane, size -= 3 * crc_lane)
+        {
+            uint64_t c1 = 0;
+            uint64_t c2 = 0;
+            for (size_t i = 0; i < crc_lane; i += 8)
+            {
+                c0 = _mm_crc32_u64(c0, load_le64(p + i));
+                c1 = _mm_crc32_u64(c1, load_le64(p + crc_lane + i));
+                c2 = _mm_crc32_u64(c2, load_le64(p + 2 * crc_lane + i));
+            }
+            c0 = shift(shift(uint32_t(c0)) ^ uint32_t(c1)) ^ uint32_t(c2);
+        }
+        for (; size >= 8; p += 8, size -= 8)
+            c0 = _mm_crc32_u64(c0, load_le64(p));
+        for (; size; size--)
+            c0 = _mm_crc32_u8(uint32_t(c0), static_cast<unsigned char>(*p++));
+        return uint32_t(c0);
+    }
+#endif
+
+    using crc_update = uint32_t (*)(uint32_t, const char*, size_t);
+
+    crc_update pick_crc()
+    {
+#ifdef HUFFMAN_CRC_SSE42
+        if (__builtin_cpu_supports("sse4.2"))
+            return crc_sse42;
+#endif
+        return crc_soft;
+    }
+
+    // Cache-line aligned bytes, allocated on first use and kept from then on.
+    class aligned_buffer
+    {
+    public:
+        char* get(size_t size)
+        {
+            if (size > capacity)
+            {
+                storage.reset(new char[size + align - 1]);
+                auto address = reinterpret_cast<uintptr_t>(storage.get());
+                data = storage.get() + (align - address % align) % align;
+                capacity = size;
+            }
+            return data;
+        }
+
+    private:
+        static const size_t align = 64;
+        std::unique_ptr<char[]> storage;
+        char* data = nullptr;
+        size_t capacity = 0;
+    };
+}
+
+constexpr char huffman::magic[3];
+const size_t huffman::default_block_size;
+const size_t huffman::max_block_size;
+const size_t huffman::max_streams;
+const size_t huffman::min_run;
+
+// Huffman tree in flat arrays. Node i joins child[i][0] and child[i][1],
+// each a node index or leaf | symb, and is created after both children, so
+// the root is the last node.
+struct huffman::flat_tree
+{
+    static const uint16_t leaf = 0x100;
+
+    struct symbol
+    {
+        uint64_t weight;
+        char symb;
+    };
+
+    std::array<symbol, 256> leaves;
+    uint16_t leaf_count = 0;
+    std::array<uint64_t, 255> weight;
+    std::array<std::array<uint16_t, 2>, 255> child;
+    uint16_t count = 0;
+};
+
+const uint16_t huffman::flat_tree::leaf;
+
+// Packs codes LSB-first into a 64-bit accumulator and stores it as a whole
+// word once it is full, draining the buffer into the stream when needed.
+// Without a stream the buffer must have room for the whole output plus 8 bytes.
+struct huffman::bit_writer
+{
+    bit_writer(std::ostream* fout, char* buffer, size_t size):
+            fout(fout),
+            begin(buffer),
+            out(buffer),
+            end(buffer + size)
+    {}
+
+    void put(uint64_t bits, uint8_t len)
+    {
+        acc |= bits << count;
+        count += len;
+        if (count >= 64)
+        {
+            if (end - out < 8)
+                drain();
+            store_le64(out, acc);
+            out += 8;
+            count -= 64;
+            acc = count ? bits >> (len - count) : 0;
+        }
+    }
+
+    // Writes the remaining bits and returns the number of padding bits in the last byte.
+    char finish()
+    {
+        size_t tail = (count + 7) / 8;
+        if (end - out < 8)
+            drain();
+        store_le64(out, acc);
+        out += tail;
+        drain();
+        return char((8 - count % 8) % 8);
+    }
+
+    // Writes out every whole byte, keeping fewer than 8 bits pending.
+    void sync()
+    {
+        if (end - out < 8)
+            drain();
+        store_le64(out, acc);
+        uint8_t bytes = count / 8;
+        out += bytes;
+        acc = bytes ? acc >> (8 * bytes) : acc;
+        count -= 8 * bytes;
+        drain();
+    }
+
+    void drain()
+    {
+        if (!fout)
+            return;
+        fout->write(begin, out - begin);
+        out = begin;
+    }
+
+    std::ostream* fout;
+    char* begin;
+    char* out;
+    char* end;
+    uint64_t acc = 0;
+    uint8_t count = 0;
+};
+
+// Reads LSB-first through a 64-bit buffer that is topped up with one unaligned
+// load. Bits at and above `count` may already hold the next partial byte.
+struct huffman::bit_reader
+{
+    bit_reader() = default;
+
+    bit_reader(const char* begin, const char* end):
+            p(begin),
+            end(end)
+    {}
+
+    // Needs at least 8 readable bytes; leaves 56 or more bits in the buffer.
+    void refill()
+    {
+        buf |= load_le64(p) << count;
+        p += (63 - count) >> 3;
+        count |= 56;
+    }
+
+    // Byte at a time near the end of the input, feeding zeros past it.
+    void refill_safe()
+    {
+        if (end - p >= 8)
+            return refill();
+        while (count <= 56)
+        {
+            if (p != end)
+                buf |= uint64_t(static_cast<unsigned char>(*p++)) << count;
+            else
+                overrun += 8;
+            count += 8;
+        }
+    }
+
+    void consume(uint8_t n)
+    {
+        buf >>= n;
+        count -= n;
+    }
+
+    // Real bits not consumed yet, negative once decoding ran past the end.
+    int64_t bits_left() const
+    {
+        return int64_t(end - p) * 8 + count - int64_t(overrun);
+    }
+
+    const char* p = nullptr;
+    const char* end = nullptr;
+    uint64_t buf = 0;
+    uint8_t count = 0;
+    uint64_t overrun = 0;
+};
+
+// Lookup table indexed by the next `bits` input bits. An entry holds up to two
+// symbols as [symb0:8][symb1:8][total bits:8][len0:6 | count:2]. Entries with
+// count 0 are escapes for codes longer than `bits`: their low 16 bits name the
+// tree node to continue from bit by bit, `invalid` for bit patterns that are
+// not a code.
+struct huffman::decode_table
+{
+    static const uint8_t lookup_bits = 11;
+    static const uint16_t leaf = 0x100;
+    static const uint16_t invalid = 0xffff;
+
+    static uint32_t single(uint8_t symb, uint8_t len)
+    {
+        return symb | uint32_t(len) << 16 | uint32_t(len) << 26 | uint32_t(1) << 24;
+    }
+
+    static uint32_t escape(uint16_t node)
+    {
+        return node;
+    }
+
+    std::array<uint32_t, 1 << lookup_bits> entries;
+    // Node 0 is the root; a child is either a node index or leaf | symb.
+    std::array<std::array<uint16_t, 2>, 256> tree;
+    uint8_t bits;
+    uint8_t max_len;
+};
+
+const uint8_t huffman::decode_table::lookup_bits;
+const uint16_t huffman::decode_table::leaf;
+const uint16_t huffman::decode_table::invalid;
+
+// Block sources for encode_blocks: next(slot, block_size, data) points data
+// at the next block and returns its size, 0 at the end. The block stays
+// valid until the same slot is filled again.
+struct huffman::stream_source
+{
+    std::istream& fin;
+    std::vector<std::vector<char>>& buffers;
+
+    size_t next(size_t slot, size_t block_size, const char*& data)
+    {
+        if (buffers.size() <= slot)
+            buffers.resize(slot + 1);
+        std::vector<char>& buffer = buffers[slot];
+        buffer.resize(block_size);
+        fin.read(buffer.data(), buffer.size());
+        data = buffer.data();
+        return size_t(fin.gcount());
+    }
+};
+
+struct huffman::memory_source
+{
+    const char* p;
+    const char* end;
+
+    size_t next(size_t, size_t block_size, const char*& data)
+    {
+        size_t size = std::min(block_size, size_t(end - p));
+        data = p;
+        p += size;
+        return size;
+    }
+};
+
+// Output of the memory encoder; the caller has sized it with encode_bound.
+struct huffman::memory_sink
+{
+    char* p;
+
+    void write(const char* data, size_t size)
+    {
+        std::memcpy(p, data, size);
+        p += size;
+    }
+};
+
+// FGK adaptive Huffman tree, updated in lock-step by encoder and decoder.
+// Nodes sit at their implicit number, so weights never decrease with the
+// index and the root is the last node. Symbols not seen yet share the
+// zero-weight NYT leaf: a first occurrence is sent as the NYT code and the
+// 8 bits of the symbol, and NYT followed by a symbol already seen ends the
+// stream.
+struct huffman::adaptive_tree
+{
+    static const uint16_t size = 2 * 257 - 1;
+    static const uint16_t root = size - 1;
+    static const uint16_t none = 0xffff;
+
+    adaptive_tree()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        weight.fill(0);
+        parent.fill(none);
+        child.fill({{none, none}});
+        symb.fill(-1);
+        leaf.fill(none);
+        nyt = root;
+        first = -1;
+    }
+
+    void put(uint8_t s, bit_writer& writer)
+    {
+        if (leaf[s] == none)
+        {
+            put_code(nyt, writer);
+            writer.put(s, 8);
+        }
+        else
+        {
+            put_code(leaf[s], writer);
+        }
+        update(s);
+    }
+
+    void put_end(bit_writer& writer)
+    {
+        if (first < 0)
+            return;
+        put_code(nyt, writer);
+        writer.put(uint8_t(first), 8);
+    }
+
+    // The next symbol, end_symbol at the end marker, or -1 if the bits run out.
+    template <class Bits>
+    int get(Bits& bits)
+    {
+        uint16_t node = root;
+        while (child[node][0] != none)
+        {
+            int b = bits.bit();
+            if (b < 0)
+                return -1;
+            node = child[node][b];
+        }
+        int s = symb[node];
+        if (node == nyt)
+        {
+            s = 0;
+            for (int i = 0; i < 8; i++)
+            {
+                int b = bits.bit();
+                if (b < 0)
+                    return -1;
+                s |= b << i;
+            }
+            if (leaf[s] != none)
+                return end_symbol;
+        }
+        update(uint8_t(s));
+        return s;
+    }
+
+    static const int end_symbol = 256;
+
+private:
+    // Codes are at most 256 bits deep, so they go out in 32-bit pieces from the root.
+    void put_code(uint16_t node, bit_writer& writer) const
+    {
+        uint8_t path[size];
+        size_t len = 0;
+        for (; node != root; node = parent[node])
+            path[len++] = child[parent[node]][1] == node;
+        while (len)
+        {
+            uint64_t bits = 0;
+            uint8_t n = 0;
+            for (; len && n < 32; n++)
+                bits |= uint64_t(path[--len]) << n;
+            writer.put(bits, n);
+        }
+    }
+
+    void update(uint8_t s)
+    {
+        uint16_t q = leaf[s];
+        if (q == none)
+        {
+            // NYT splits into a new NYT on the left and the symbol on the right.
+            uint16_t old = nyt;
+            child[old] = {{uint16_t(old - 2), uint16_t(old - 1)}};
+            parent[old - 2] = old;
+            parent[old - 1] = old;
+            symb[old - 1] = s;
+            leaf[s] = old - 1;
+            nyt = old - 2;
+            q = old - 1;
+            if (first < 0)
+                first = s;
+        }
+
+        // Before a node's weight grows it moves to the top of its weight
+        // class, unless that is its own parent, which keeps the sibling property.
+        while (true)
+        {
+            uint16_t leader = q;
+            while (leader < root && weight[leader + 1] == weight[q])
+                leader++;
+            if (leader != q && leader != parent[q])
+            {
+                swap_nodes(q, leader);
+                q = leader;
+            }
+            weight[q]++;
+            if (q == root)
+                break;
+            q = parent[q];
+        }
+    }
+
+    // Exchanges the subtrees at two positions; parents stay with the positions.
+    void swap_nodes(uint16_t a, uint16_t b)
+    {
+        std::swap(weight[a], weight[b]);
+        std::swap(child[a], child[b]);
+        std::swap(symb[a], symb[b]);
+        for (uint16_t n : {a, b})
+        {
+            if (child[n][0] != none)
+            {
+                parent[child[n][0]] = n;
+                parent[child[n][1]] = n;
+            }
+            else if (symb[n] >= 0)
+            {
+                leaf[symb[n]] = n;
+            }
+            else
+            {
+                nyt = n;
+            }
+        }
+    }
+
+    std::array<uint64_t, size> weight;
+    std::array<uint16_t, size> parent;
+    std::array<std::array<uint16_t, 2>, size> child;
+    std::array<int16_t, size> symb;
+    std::array<uint16_t, 256> leaf;
+    uint16_t nyt = root;
+    int first = -1;
+};
+
+const uint16_t huffman::adaptive_tree::size;
+const uint16_t huffman::adaptive_tree::root;
+const uint16_t huffman::adaptive_tree::none;
+const int huffman::adaptive_tree::end_symbol;
+
+// Counts and tables encode_order1 works in, 300 KB that are kept per slot
+// rather than put on the stack.
+struct huffman::order1_scratch
+{
+    std::array<std::array<uint32_t, 256>, 256> contexts;
+    std::array<std::array<uint64_t, 256>, max_clusters> freq;
+    std::array<std::array<float, 256>, max_clusters> cost;
+    std::array<std::array<uint8_t, 256>, max_clusters> lengths;
+    std::array<std::array<code, 256>, max_clusters> codes;
+    // The layout chosen by layout_order1 for code_order1.
+    std::array<uint8_t, 256> cluster;
+    size_t clusters;
+    uint8_t width;
+    size_t bytes;
+};
+
+// A dictionary added to an encoder or decoder, ready to code with.
+struct huffman::shared_table
+{
+    uint32_t id;
+    uint8_t max_len;
+    std::array<code, 256> codes;
+    // Pads the last byte with its first bits.
+    code longest;
+    decode_table table;
+};
+
+// Bytes [start, start + length) of a block, all equal to symb.
+struct huffman::byte_run
+{
+    size_t start;
+    size_t length;
     char symb;
-    uint64_t weight;
-    bool single;
-    std::unique_ptr<Node> left;
-    std::unique_ptr<Node> right;
-
-    Node(char symb,
-         uint64_t weight,
-         bool single = true,
-         std::unique_ptr<Node> left = nullptr,
-         std::unique_ptr<Node> right = nullptr):
-            symb(symb),
-            weight(weight),
-            single(single),
-            left(std::move(left)),
-            right(std::move(right))
+};
+
+// Lists package_merge works in, kept by the caller so that they keep their
+// capacity from block to block.
+struct huffman::merge_lists
+{
+    struct item
+    {
+        uint64_t weight;
+        int16_t symb;     // -1 for a package of child and child + 1
+        uint16_t child;
+    };
+
+    std::vector<item> leaves;
+    std::vector<std::vector<item>> lists;
+    std::vector<std::pair<uint8_t, uint16_t>> stack;
+};
+
+// Block being coded by encode_blocks, with the buffers it is coded into; it
+// is its own task on the pool.
+struct huffman::block_slot : thread_pool::task
+{
+    void run() override
+    {
+        encode_block(*this, *work);
+    }
+
+    workspace const* work;
+    const char* data;
+    size_t size;
+    char type;
+    std::vector<char> payload;
+    // The order-1 payload, kept when it is the smaller one.
+    std::vector<char> alt;
+    std::unique_ptr<order1_scratch> order1;
+    merge_lists merge;
+    // Set by plan_block before the block is handed out: its per-stream
+    // counts and `type`, with the lengths of an order-0 type, which are the
+    // last table sent for a repeat block, and the dictionary of a shared one.
+    bool planned = false;
+    std::array<std::array<uint64_t, 256>, max_streams> seg_freq;
+    std::array<uint8_t, 256> lengths;
+    shared_table const* dictionary;
+    // The runs found by layout_runs, the lengths of the literals between
+    // them and where their bitstream starts in `alt`.
+    std::vector<byte_run> runs;
+    std::array<uint8_t, 256> run_lengths;
+    size_t run_header;
+    uint32_t crc;
+};
+
+// Blocks of a framed stream read by decode_blocks, decoded while the next
+// batch is read.
+struct huffman::decode_batch
+{
+    std::vector<char> in;
+    std::vector<block_ref> blocks;
+    std::vector<char> out;
+    std::vector<char> ok;
+};
+
+// Decode tables one task keeps from block to block. table_id is the stream's
+// number for the order-0 table in tables[0], 0 if it holds none.
+struct huffman::block_tables
+{
+    std::vector<decode_table> tables;
+    uint64_t table_id = 0;
+};
+
+// Decodes every step-th block from `first` with one set of tables, marking
+// in `ok` whether each decoded intact.
+struct huffman::decode_task : thread_pool::task
+{
+    decode_task() = default;
+
+    decode_task(std::vector<block_ref> const& blocks, const char* src, char* dst, std::vector<char>& ok,
+                block_tables& tables, workspace const& work, size_t first, size_t step):
+            blocks(&blocks),
+            src(src),
+            dst(dst),
+            ok(&ok),
+            tables(&tables),
+            work(&work),
+            first(first),
+            step(step)
     {}
+
+    void run() override
+    {
+        for (size_t i = first; i < blocks->size(); i += step)
+            (*ok)[i] = decode_block((*blocks)[i], src, dst, *tables, *work) && check_block((*blocks)[i], dst);
+    }
+
+    std::vector<block_ref> const* blocks;
+    const char* src;
+    char* dst;
+    std::vector<char>* ok;
+    block_tables* tables;
+    workspace const* work;
+    size_t first;
+    size_t step;
 };
 
-void huffman::encode(std::istream &fin, std::ostream &fout)
+// What an encoder or decoder keeps between calls. Everything is allocated on
+// first use and only ever grows.
+struct huffman::workspace
+{
+    explicit workspace(options const& opts):
+            opts(opts)
+    {}
+
+    // Worker threads, started by the first call that has a use for them.
+    thread_pool* workers()
+    {
+        if (opts.threads > 1 && !pool)
+            pool.reset(new thread_pool(opts.threads));
+        return pool.get();
+    }
+
+    adaptive_tree& fresh_tree()
+    {
+        if (tree)
+            tree->reset();
+        else
+            tree.reset(new adaptive_tree());
+        return *tree;
+    }
+
+    // Decode tables for each of `tasks` blocks decoded at the same time,
+    // holding no table of the stream about to be decoded.
+    std::vector<block_tables>& task_tables(size_t tasks)
+    {
+        if (tables.size() < tasks)
+            tables.resize(tasks);
+        for (auto& t : tables)
+            t.table_id = 0;
+        return tables;
+    }
+
+    shared_table const* find_dictionary(uint32_t id) const
+    {
+        for (auto const& dict : dictionaries)
+        {
+            if (dict->id == id)
+                return dict.get();
+        }
+        return nullptr;
+    }
+
+    decode_table& single_table()
+    {
+        std::vector<decode_table>& first = task_tables(1)[0].tables;
+        if (first.empty())
+            first.resize(1);
+        return first[0];
+    }
+
+    options opts;
+    aligned_buffer in;
+    aligned_buffer out;
+    std::unique_ptr<thread_pool> pool;
+    std::unique_ptr<adaptive_tree> tree;
+    std::vector<block_tables> tables;
+    std::vector<std::unique_ptr<shared_table>> dictionaries;
+
+    // Encoding.
+    std::vector<std::vector<char>> source_buffers;
+    std::vector<block_slot> slots;
+    std::vector<char> count_batches[2];
+    std::vector<std::array<uint64_t, 256>> parts;
+    std::vector<count_task> count_tasks;
+    merge_lists merge;
+    // The last table a framed stream sent, for reuse_tables.
+    bool table_sent = false;
+    std::array<uint8_t, 256> table_lengths = {};
+
+    // Decoding.
+    decode_batch batches[2];
+    // Lengths of the last table read by decode_blocks and its number, for
+    // repeat blocks of a later batch.
+    std::vector<char> last_table;
+    uint64_t last_table_id = 0;
+    bool checksums = false;
+    std::vector<block_ref> blocks;
+    std::vector<char> ok;
+    std::vector<decode_task> decode_tasks;
+};
+
+// Codes whatever input is available and writes out every whole byte before
+// waiting for more, so a byte's code leaves as soon as the byte arrives.
+void huffman::encode_adaptive(std::istream& fin, std::ostream& fout, workspace& work)
+{
+    char header[sizeof(magic) + 1];
+    *std::copy(magic, magic + sizeof(magic), header) = adaptive_version;
+    fout.write(header, sizeof(header));
+
+    adaptive_tree& tree = work.fresh_tree();
+    char* buffer = work.in.get(buf_size);
+    bit_writer writer(&fout, work.out.get(buf_size), buf_size);
+    while (true)
+    {
+        int c = fin.get();
+        if (c == std::char_traits<char>::eof())
+            break;
+        buffer[0] = char(c);
+        auto size = 1 + size_t(fin.readsome(buffer + 1, buf_size - 1));
+        for (size_t i = 0; i < size; i++)
+            tree.put(uint8_t(buffer[i]), writer);
+        writer.sync();
+        fout.flush();
+    }
+    tree.put_end(writer);
+    writer.finish();
+}
+
+void huffman::encode_adaptive(const char* src, size_t size, bit_writer& writer, workspace& work)
+{
+    char header[sizeof(magic) + 1];
+    *std::copy(magic, magic + sizeof(magic), header) = adaptive_version;
+    for (char h : header)
+        writer.put(uint8_t(h), 8);
+
+    adaptive_tree& tree = work.fresh_tree();
+    for (const char* c = src; c != src + size; c++)
+        tree.put(uint8_t(*c), writer);
+    tree.put_end(writer);
+    writer.finish();
+}
+
+// Stream side of the adaptive decoder: decoded bytes are written out
+// before blocking for more input.
+struct huffman::adaptive_stream
+{
+    std::istream& fin;
+    std::ostream& fout;
+    // Both buf_size bytes.
+    char* in;
+    char* out;
+    size_t in_pos = 0;
+    size_t in_size = 0;
+    size_t out_size = 0;
+    uint32_t acc = 0;
+    uint8_t count = 0;
+    bool started = false;
+
+    int bit()
+    {
+        if (!count)
+        {
+            if (in_pos == in_size && !fill())
+                return -1;
+            acc = static_cast<unsigned char>(in[in_pos++]);
+            count = 8;
+        }
+        started = true;
+        int b = acc & 1;
+        acc >>= 1;
+        count--;
+        return b;
+    }
+
+    bool fill()
+    {
+        flush();
+        int c = fin.get();
+        if (c == std::char_traits<char>::eof())
+            return false;
+        in[0] = char(c);
+        in_size = 1 + size_t(fin.readsome(in + 1, buf_size - 1));
+        in_pos = 0;
+        return true;
+    }
+
+    bool put(char c)
+    {
+        if (out_size == buf_size)
+            flush();
+        out[out_size++] = c;
+        return true;
+    }
+
+    void flush()
+    {
+        fout.write(out, out_size);
+        fout.flush();
+        out_size = 0;
+    }
+};
+
+struct huffman::adaptive_memory
+{
+    const char* p;
+    const char* end;
+    char* out;
+    char* out_end;
+    uint32_t acc = 0;
+    uint8_t count = 0;
+    bool started = false;
+
+    int bit()
+    {
+        if (!count)
+        {
+            if (p == end)
+                return -1;
+            acc = static_cast<unsigned char>(*p++);
+            count = 8;
+        }
+        started = true;
+        int b = acc & 1;
+        acc >>= 1;
+        count--;
+        return b;
+    }
+
+    bool put(char c)
+    {
+        if (out == out_end)
+            return false;
+        *out++ = c;
+        return true;
+    }
+
+    void flush()
+    {}
+};
+
+// An empty input has no bits at all; anything else must reach the end marker.
+template <class IO>
+bool huffman::decode_adaptive(IO& io, adaptive_tree& tree)
+{
+    while (true)
+    {
+        int s = tree.get(io);
+        if (s < 0 || s == adaptive_tree::end_symbol)
+        {
+            io.flush();
+            return s == adaptive_tree::end_symbol || !io.started;
+        }
+        if (!io.put(char(s)))
+            return false;
+    }
+}
+
+huffman::encoder::encoder(options const& opts):
+        work(new workspace(opts))
+{}
+
+huffman::encoder::~encoder() = default;
+huffman::encoder::encoder(encoder&&) noexcept = default;
+huffman::encoder& huffman::encoder::operator=(encoder&&) noexcept = default;
+
+huffman::decoder::decoder(options const& opts):
+        work(new workspace(opts))
+{}
+
+huffman::decoder::~decoder() = default;
+huffman::decoder::decoder(decoder&&) noexcept = default;
+huffman::decoder& huffman::decoder::operator=(decoder&&) noexcept = default;
+
+void huffman::encode(std::istream &fin, std::ostream &fout)
+{
+    encode(fin, fout, options());
+}
+
+// Four sub-histograms fed from 64-bit loads: a run of equal bytes spreads
+// its increments over four counters instead of waiting on one store. Also
+// returns how many of the 16-byte steps hold a single byte value, one
+// compare per step that tells whether a block has runs worth looking for.
+size_t huffman::histogram_runs(const char* data, size_t size, std::array<uint64_t, 256>& freq)
+{
+    // 32-bit counters keep the tables in 4 KB; a chunk can't overflow them.
+    const size_t chunk = size_t(1) << 30;
+    const uint64_t ones = 0x0101010101010101;
+    uint32_t sub[4][256];
+    size_t uniform = 0;
+
+    while (size)
+    {
+        size_t n = std::min(size, chunk);
+        std::memset(sub, 0, sizeof(sub));
+        const char* p = data;
+        const char* end = data + n;
+        for (; end - p >= 16; p += 16)
+        {
+            uint64_t a = load_le64(p);
+            uint64_t b = load_le64(p + 8);
+            uniform += a == b && a == (a & 0xff) * ones;
+            for (int k = 0; k < 64; k += 16)
+            {
+                sub[0][uint8_t(a >> k)]++;
+                sub[1][uint8_t(a >> (k + 8))]++;
+                sub[2][uint8_t(b >> k)]++;
+                sub[3][uint8_t(b >> (k + 8))]++;
+            }
+        }
+        for (; p != end; p++)
+            sub[0][static_cast<unsigned char>(*p)]++;
+
+        for (uint32_t i = 0; i != 256; ++i)
+            freq[i] += uint64_t(sub[0][i]) + sub[1][i] + sub[2][i] + sub[3][i];
+        data += n;
+        size -= n;
+    }
+    return uniform;
+}
+
+void huffman::histogram(const char* data, size_t size, std::array<uint64_t, 256>& freq)
+{
+    histogram_runs(data, size, freq);
+}
+
+uint32_t huffman::crc32c(const char* data, size_t size, uint32_t crc)
+{
+    static const crc_update update = pick_crc();
+    return ~update(~crc, data, size);
+}
+
+void huffman::histogram(const char* data, size_t size, std::array<uint64_t, 256>& freq, unsigned threads)
+{
+    if (threads <= 1 || size < hist_slice)
+        return histogram(data, size, freq);
+
+    thread_pool pool(threads);
+    std::vector<std::array<uint64_t, 256>> parts;
+    std::vector<count_task> tasks;
+    count_parallel(pool, threads, data, size, freq, parts, tasks);
+}
+
+// Counts the whole stream. With several threads each batch is split across
+// per-thread arrays while the next batch is read.
+void huffman::count_stream(std::istream& fin, std::array<uint64_t, 256>& freq, workspace& work)
+{
+    thread_pool* pool = work.workers();
+    if (!pool)
+    {
+        char* buffer = work.in.get(buf_size);
+        while (fin)
+        {
+            fin.read(buffer, buf_size * sizeof(char));
+            histogram(buffer, size_t(fin.gcount()), freq);
+        }
+        return;
+    }
+
+    unsigned threads = work.opts.threads;
+    std::vector<std::array<uint64_t, 256>>& parts = work.parts;
+    parts.assign(threads, std::array<uint64_t, 256>());
+    std::vector<char>* batches = work.count_batches;
+    std::vector<count_task>& tasks = work.count_tasks;
+    size_t batch_size = threads * hist_slice;
+    batches[0].resize(batch_size);
+    fin.read(batches[0].data(), batch_size);
+    batches[0].resize(size_t(fin.gcount()));
+
+    for (size_t cur = 0; !batches[cur].empty(); cur ^= 1)
+    {
+        count_slices(*pool, batches[cur].data(), batches[cur].size(), parts, tasks);
+
+        std::vector<char>& next = batches[cur ^ 1];
+        next.resize(fin ? batch_size : 0);
+        fin.read(next.data(), next.size());
+        next.resize(size_t(fin.gcount()));
+
+        for (auto& t : tasks)
+            t.wait();
+    }
+
+    for (auto const& part : parts)
+        for (uint32_t i = 0; i != 256; ++i)
+            freq[i] += part[i];
+}
+
+// Input in memory is split across the threads once there is a slice for each.
+void huffman::count_memory(const char* data, size_t size, std::array<uint64_t, 256>& freq, workspace& work)
+{
+    thread_pool* pool = size >= hist_slice ? work.workers() : nullptr;
+    if (!pool)
+        return histogram(data, size, freq);
+    count_parallel(*pool, work.opts.threads, data, size, freq, work.parts, work.count_tasks);
+}
+
+void huffman::encode(std::istream &fin, std::ostream &fout, options const& opts)
+{
+    encoder(opts).encode(fin, fout);
+}
+
+void huffman::encoder::encode(std::istream& fin, std::ostream& fout)
+{
+    options const& opts = work->opts;
+    if (opts.adaptive)
+        return encode_adaptive(fin, fout, *work);
+    if (opts.block_size || fin.tellg() == std::istream::pos_type(-1))
+    {
+        fin.clear();
+        stream_source source{fin, work->source_buffers};
+        return encode_blocks(source, fout, *work);
+    }
+
+    std::array<uint64_t, 256> freq = {};
+    count_stream(fin, freq, *work);
+    std::array<code, 256> codes = {};
+    write_single_header(freq, *work, fout, codes);
+
+    fin.clear();
+    fin.seekg(0, std::ios::beg);
+
+    char* buffer = work->in.get(buf_size);
+    bit_writer writer(&fout, work->out.get(buf_size), buf_size);
+
+    while(fin)
+    {
+        fin.read(buffer, buf_size * sizeof(char));
+        put_codes(buffer, size_t(fin.gcount()), codes, writer);
+    }
+
+    writer.finish();
+}
+
+// Input already in memory, such as a mapped file, is coded in place: blocks
+// are not copied into buffers and the single-table format needs no rewind.
+void huffman::encode(const char* src, size_t size, std::ostream& fout, options const& opts)
+{
+    encoder(opts).encode(src, size, fout);
+}
+
+void huffman::encoder::encode(const char* src, size_t size, std::ostream& fout)
+{
+    options const& opts = work->opts;
+    if (opts.adaptive)
+    {
+        bit_writer writer(&fout, work->out.get(buf_size), buf_size);
+        return encode_adaptive(src, size, writer, *work);
+    }
+    if (opts.block_size)
+    {
+        memory_source source{src, src + size};
+        return encode_blocks(source, fout, *work);
+    }
+
+    std::array<uint64_t, 256> freq = {};
+    count_memory(src, size, freq, *work);
+    std::array<code, 256> codes = {};
+    write_single_header(freq, *work, fout, codes);
+
+    bit_writer writer(&fout, work->out.get(buf_size), buf_size);
+    put_codes(src, size, codes, writer);
+    writer.finish();
+}
+
+size_t huffman::encode_bound(size_t size, options const& opts)
+{
+    // FGK stays within twice the static code plus a bit per byte, and
+    // every first occurrence adds up to 8 + 256 bits of NYT code and literal.
+    if (opts.adaptive)
+        return sizeof(magic) + 1 + size / 8 * 17 + size % 8 * 3 + 256 * (8 + 256) / 8 + 64;
+    // No code is longer in total than the fixed 8-bit one, so a block's
+    // bitstreams take at most its raw size plus a padding byte per stream.
+    if (!opts.block_size)
+        return sizeof(magic) + 2 + max_header_size + size + 8;
+    size_t block_size = std::min(opts.block_size, max_block_size);
+    size_t blocks = (size + block_size - 1) / block_size;
+    return 16 + blocks * (25 + max_header_size + 1 + 11 * max_streams) + size + 1;
+}
+
+size_t huffman::encode(const char* src, size_t size, char* dst, size_t capacity, options const& opts)
+{
+    return encoder(opts).encode(src, size, dst, capacity);
+}
+
+size_t huffman::encoder::encode(const char* src, size_t size, char* dst, size_t capacity)
+{
+    options const& opts = work->opts;
+    if (capacity < encode_bound(size, opts))
+        return 0;
+
+    if (opts.adaptive)
+    {
+        bit_writer writer(nullptr, dst, capacity);
+        encode_adaptive(src, size, writer, *work);
+        return size_t(writer.out - dst);
+    }
+    memory_sink out{dst};
+    if (opts.block_size)
+    {
+        memory_source source{src, src + size};
+        encode_blocks(source, out, *work);
+        return size_t(out.p - dst);
+    }
+
+    std::array<uint64_t, 256> freq = {};
+    count_memory(src, size, freq, *work);
+    std::array<code, 256> codes = {};
+    write_single_header(freq, *work, out, codes);
+
+    bit_writer writer(nullptr, out.p, dst + capacity - out.p);
+    put_codes(src, size, codes, writer);
+    writer.finish();
+    return size_t(writer.out - dst);
+}
+
+void huffman::put_codes(const char* src, size_t size, std::array<code, 256> const& codes, bit_writer& writer)
+{
+    for (const char* c = src; c != src + size; c++)
+    {
+        code const& symb_code = codes[static_cast<unsigned char>(*c)];
+        writer.put(symb_code.bits, symb_code.len);
+    }
+}
+
+// The bit length is known from the histogram, so the header is final
+// before any code is written and the output never has to be rewound.
+template <class Out>
+void huffman::write_single_header(std::array<uint64_t, 256> const& freq, workspace& work, Out& fout,
+                                  std::array<code, 256>& codes)
+{
+    std::array<uint8_t, 256> lengths = {};
+    code_lengths(freq, lengths, work.opts.max_code_length, work.merge);
+    canonical_codes(lengths, codes);
+
+    uint64_t bits = 0;
+    for (uint32_t i = 0; i != 256; ++i)
+        bits += freq[i] * lengths[i];
+
+    char header[max_header_size];
+    char* h = std::copy(magic, magic + sizeof(magic), header);
+    *h++ = single_version;
+    *h++ = char((8 - bits % 8) % 8);
+    h = write_lengths(lengths, h);
+    fout.write(header, h - header);
+}
+
+bool huffman::decode(std::istream &fin, std::ostream &fout)
+{
+    return decode(fin, fout, options());
+}
+
+// Header of a single-table stream, either tagged or the legacy frequency table.
+bool huffman::single_header(const char*& p, const char* end, decode_table& table, char& fake_zero)
+{
+    if (end - p >= ptrdiff_t(sizeof(magic)) + 1 && std::equal(magic, magic + sizeof(magic), p))
+    {
+        if (p[sizeof(magic)] != single_version)
+            return false;
+        p += sizeof(magic) + 1;
+        std::array<uint8_t, 256> lengths = {};
+        if (p == end)
+            return false;
+        fake_zero = *p++;
+        if (!read_lengths(p, end, lengths) || !canonical_table(lengths, table))
+            return false;
+    }
+    else if (!legacy_table(p, end, table, fake_zero))
+    {
+        return false;
+    }
+    return fake_zero >= 0 && fake_zero <= 7;
+}
+
+bool huffman::decode(std::istream &fin, std::ostream &fout, options const& opts)
+{
+    return decoder(opts).decode(fin, fout);
+}
+
+bool huffman::decoder::decode(std::istream& fin, std::ostream& fout)
+{
+    char* buffer = work->in.get(buf_size);
+    fin.read(buffer, sizeof(magic) + 1);
+    auto got = size_t(fin.gcount());
+    bool tagged = got == sizeof(magic) + 1 && std::equal(magic, magic + sizeof(magic), buffer);
+    if (tagged && buffer[sizeof(magic)] == block_version)
+        return decode_blocks(fin, fout, *work);
+    if (tagged && buffer[sizeof(magic)] == adaptive_version)
+    {
+        adaptive_stream io{fin, fout, buffer, work->out.get(buf_size)};
+        return decode_adaptive(io, work->fresh_tree());
+    }
+
+    fin.read(buffer + got, buf_size - got);
+    const char* p = buffer;
+    const char* end = buffer + got + fin.gcount();
+
+    shared_table const* dict = nullptr;
+    char fake_zero = 0;
+    if (tagged && buffer[sizeof(magic)] == shared_version)
+    {
+        if (!(dict = shared_header(p, end, *work)))
+            return false;
+    }
+    else if (!single_header(p, end, work->single_table(), fake_zero))
+    {
+        return false;
+    }
+    decode_table const& table = dict ? dict->table : work->single_table();
+
+    // Keep enough bytes ahead that one symbol never reads past the chunk.
+    size_t margin = 16 + (table.max_len + 7) / 8;
+
+    char* buffer_out = work->out.get(buf_size);
+    char* out_end = buffer_out + buf_size;
+    char* out = buffer_out;
+    bit_reader reader(p, end);
+    bool last = !fin || fin.peek() == std::char_traits<char>::eof();
+
+    while (true)
+    {
+        while (size_t(reader.end - reader.p) >= margin)
+        {
+            if (!decode_fast(reader, table, out, out_end, margin))
+                return false;
+            if (out_end - out < 8)
+            {
+                fout.write(buffer_out, out - buffer_out);
+                out = buffer_out;
+            }
+        }
+        if (last)
+            break;
+
+        auto left = size_t(reader.end - reader.p);
+        std::memmove(buffer, reader.p, left);
+        fin.read(buffer + left, buf_size - left);
+        auto read = size_t(fin.gcount());
+        last = read < buf_size - left || fin.peek() == std::char_traits<char>::eof();
+        reader.p = buffer;
+        reader.end = buffer + left + read;
+    }
+
+    char symb;
+    int decoded;
+    while ((decoded = tail_symbol(reader, table, symb, dict ? -1 : fake_zero)) > 0)
+    {
+        if (out == out_end)
+        {
+            fout.write(buffer_out, out - buffer_out);
+            out = buffer_out;
+        }
+        *out++ = symb;
+    }
+    if (decoded < 0)
+        return false;
+    fout.write(buffer_out, out - buffer_out);
+
+    return true;
+}
+
+// Framed format: magic, version, varint block size and a flags byte, then
+// blocks of [type][varint raw size][varint payload size][payload]. Every
+// block carries its own table, so blocks code and decode independently and
+// input is read once, except that a repeat block codes with the table of the
+// last block that sent one. An end block closes the stream. With the
+// checksum flag each payload is preceded by the CRC-32C of the block's
+// bytes, 4 bytes little-endian.
+//
+// With several threads two blocks per thread are kept in flight: while the
+// workers code, the next blocks are read, and finished ones are written
+// strictly in input order so the output does not depend on the thread count.
+template <class Source, class Out>
+void huffman::encode_blocks(Source& source, Out& fout, workspace& work)
+{
+    options const& opts = work.opts;
+    size_t block_size = opts.block_size ? std::min(opts.block_size, max_block_size) : default_block_size;
+
+    char header[16];
+    char* h = std::copy(magic, magic + sizeof(magic), header);
+    *h++ = block_version;
+    h = put_varint(h, block_size);
+    *h++ = opts.checksums ? flag_checksums : 0;
+    fout.write(header, h - header);
+
+    std::vector<block_slot>& slots = work.slots;
+    slots.resize(opts.threads > 1 ? 2 * opts.threads : 1);
+    thread_pool* pool = work.workers();
+    size_t head = 0;
+    size_t pending = 0;
+    work.table_sent = false;
+
+    auto flush_head = [&]() {
+        block_slot& s = slots[head];
+        s.wait();
+        write_block(fout, s, opts.checksums);
+        head = (head + 1) % slots.size();
+        pending--;
+    };
+
+    while (true)
+    {
+        if (pending == slots.size())
+            flush_head();
+
+        size_t index = (head + pending) % slots.size();
+        block_slot& s = slots[index];
+        s.size = source.next(index, block_size, s.data);
+        if (!s.size)
+            break;
+        s.planned = false;
+        if (opts.reuse_tables)
+            plan_block(s, work);
+
+        s.work = &work;
+        if (pool)
+            pool->submit(s);
+        else
+            encode_block(s, work);
+        pending++;
+    }
+    while (pending)
+        flush_head();
+
+    char last = block_end;
+    fout.write(&last, sizeof(last));
+}
+
+template <class Out>
+void huffman::write_block(Out& fout, block_slot const& slot, bool checksum)
+{
+    std::vector<char> const& payload = slot.payload;
+    char sizes[25];
+    char* s = sizes;
+    *s++ = slot.type;
+    s = put_varint(put_varint(s, slot.size), payload.size());
+    for (size_t i = 0; checksum && i < 4; i++)
+        *s++ = char(slot.crc >> (8 * i));
+    fout.write(sizes, s - sizes);
+    fout.write(payload.data(), payload.size());
+}
+
+// Blocks are read in batches of two per thread. The raw sizes give every
+// block its offset in the batch output, which is sized up front so that the
+// workers decode straight into place while the next batch is being read.
+// A block whose payload does not decode is left as zeros so that the blocks
+// after it keep their offsets; the stream is then reported corrupt.
+bool huffman::decode_blocks(std::istream& fin, std::ostream& fout, workspace& work)
+{
+    uint64_t block_size;
+    char flags;
+    if (!read_varint(fin, block_size) || block_size == 0 || block_size > max_block_size
+            || !fin.get(flags) || (flags & ~flag_checksums) != 0)
+        return false;
+    work.checksums = flags & flag_checksums;
+
+    unsigned threads = std::max(work.opts.threads, 1u);
+    decode_batch* batches = work.batches;
+    batches[0].blocks.clear();
+    batches[1].blocks.clear();
+    thread_pool* pool = work.workers();
+    std::vector<block_tables>& tables = work.task_tables(2 * threads);
+    std::vector<decode_task>& tasks = work.decode_tasks;
+    work.last_table_id = 0;
+
+    bool more = true;
+    bool readable = read_batch(fin, batches[0], block_size, 2 * threads, more, work);
+    bool intact = true;
+    for (size_t cur = 0; !batches[cur].blocks.empty(); cur ^= 1)
+    {
+        decode_batch& b = batches[cur];
+        b.out.resize(b.blocks.back().offset + b.blocks.back().raw);
+        b.ok.assign(b.blocks.size(), 1);
+        tasks.resize(b.blocks.size());
+        for (size_t i = 0; i < b.blocks.size(); i++)
+        {
+            tasks[i] = decode_task(b.blocks, b.in.data(), b.out.data(), b.ok, tables[i], work, i, b.blocks.size());
+            if (pool)
+                pool->submit(tasks[i]);
+            else
+                tasks[i].run();
+        }
+
+        batches[cur ^ 1].blocks.clear();
+        if (readable && more)
+            readable = read_batch(fin, batches[cur ^ 1], block_size, 2 * threads, more, work);
+
+        for (size_t i = 0; i < b.blocks.size(); i++)
+            tasks[i].wait();
+        for (size_t i = 0; i < b.blocks.size(); i++)
+        {
+            if (!b.ok[i])
+            {
+                std::fill_n(b.out.begin() + b.blocks[i].offset, b.blocks[i].raw, 0);
+                intact = false;
+            }
+        }
+        fout.write(b.out.data(), b.out.size());
+    }
+    return readable && !more && intact;
+}
+
+bool huffman::decoded_size(const char* src, size_t size, uint64_t& raw)
+{
+    std::vector<block_ref> blocks;
+    if (!parse_blocks(src, size, blocks))
+        return false;
+    raw = blocks.empty() ? 0 : blocks.back().offset + blocks.back().raw;
+    return true;
+}
+
+// A framed stream decodes straight into place, one task per block, with
+// failed blocks zeroed as in decode_blocks. A single-table stream runs the
+// lookup kernel over the whole input at once.
+bool huffman::decode(const char* src, size_t size, char* dst, size_t capacity, size_t& written, options const& opts)
+{
+    return decoder(opts).decode(src, size, dst, capacity, written);
+}
+
+bool huffman::decoder::decode(const char* src, size_t size, char* dst, size_t capacity, size_t& written)
+{
+    written = 0;
+    if (size > sizeof(magic) && std::equal(magic, magic + sizeof(magic), src) && src[sizeof(magic)] == block_version)
+    {
+        std::vector<block_ref>& blocks = work->blocks;
+        blocks.clear();
+        if (!parse_blocks(src, size, blocks))
+            return false;
+        uint64_t raw = blocks.empty() ? 0 : blocks.back().offset + blocks.back().raw;
+        if (raw > capacity)
+            return false;
+        written = size_t(raw);
+        return decode_parsed(src, blocks, dst, *work);
+    }
+
+    if (size > sizeof(magic) && std::equal(magic, magic + sizeof(magic), src) && src[sizeof(magic)] == adaptive_version)
+    {
+        adaptive_memory io{src + sizeof(magic) + 1, src + size, dst, dst + capacity};
+        bool ok = decode_adaptive(io, work->fresh_tree());
+        written = size_t(io.out - dst);
+        return ok;
+    }
+
+    const char* p = src;
+    shared_table const* dict = nullptr;
+    char fake_zero = 0;
+    if (size > sizeof(magic) && std::equal(magic, magic + sizeof(magic), src) && src[sizeof(magic)] == shared_version)
+    {
+        if (!(dict = shared_header(p, src + size, *work)))
+            return false;
+    }
+    else if (!single_header(p, src + size, work->single_table(), fake_zero))
+    {
+        return false;
+    }
+    decode_table const& table = dict ? dict->table : work->single_table();
+
+    bit_reader reader(p, src + size);
+    char* out = dst;
+    if (!decode_fast(reader, table, out, dst + capacity, 16 + (table.max_len + 7) / 8))
+        return false;
+    char symb;
+    int decoded;
+    while ((decoded = tail_symbol(reader, table, symb, dict ? -1 : fake_zero)) > 0)
+    {
+        if (out == dst + capacity)
+            return false;
+        *out++ = symb;
+    }
+    written = size_t(out - dst);
+    return decoded == 0;
+}
+
+// Decodes one of the symbols left once the input is too short for the
+// lookup kernel: 1 for a symbol, 0 at the end of the stream, -1 if it is
+// corrupt. A negative fake_zero marks a stream padded with the start of a
+// code (see finish_shared), which ends at the code that would need bits past
+// the input.
+int huffman::tail_symbol(bit_reader& reader, decode_table const& table, char& symb, int fake_zero)
+{
+    int64_t left = reader.bits_left();
+    if (left <= std::max(fake_zero, 0))
+        return 0;
+    if (!decode_one(reader, table, symb))
+        return -1;
+    if (fake_zero >= 0)
+        return reader.bits_left() < fake_zero ? -1 : 1;
+    if (reader.bits_left() >= 0)
+        return 1;
+    return left < 8 ? 0 : -1;
+}
+
+// Every byte value gets a code: bytes missing from the samples are counted
+// once, which gives them the longest codes.
+huffman::dictionary huffman::train_dictionary(const char* samples, size_t size, options const& opts)
+{
+    std::array<uint64_t, 256> freq = {};
+    histogram(samples, size, freq, opts.threads);
+    for (auto& f : freq)
+        f = std::max<uint64_t>(f, 1);
+
+    dictionary dict;
+    merge_lists merge;
+    code_lengths(freq, dict.lengths, opts.max_code_length, merge);
+    // FNV-1a of the lengths.
+    dict.id = 2166136261u;
+    for (auto len : dict.lengths)
+    {
+        dict.id ^= len;
+        dict.id *= 16777619u;
+    }
+    return dict;
+}
+
+// Magic, version, varint id and the lengths as in a block header.
+void huffman::write_dictionary(dictionary const& dict, std::ostream& fout)
+{
+    char buffer[sizeof(magic) + 1 + 5 + max_header_size];
+    char* h = std::copy(magic, magic + sizeof(magic), buffer);
+    *h++ = dictionary_version;
+    h = put_varint(h, dict.id);
+    h = write_lengths(dict.lengths, h);
+    fout.write(buffer, h - buffer);
+}
+
+bool huffman::read_dictionary(std::istream& fin, dictionary& dict)
+{
+    char buffer[sizeof(magic) + 1 + 5 + max_header_size];
+    fin.read(buffer, sizeof(buffer));
+    const char* p = buffer;
+    const char* end = buffer + fin.gcount();
+    if (end - p < ptrdiff_t(sizeof(magic)) + 1 || !std::equal(magic, magic + sizeof(magic), p)
+            || p[sizeof(magic)] != dictionary_version)
+        return false;
+    p += sizeof(magic) + 1;
+
+    uint64_t id;
+    std::array<uint8_t, 256> lengths;
+    if (!get_varint(p, end, id) || id > std::numeric_limits<uint32_t>::max()
+            || !read_lengths(p, end, lengths) || !complete_code(lengths))
+        return false;
+    dict.id = uint32_t(id);
+    dict.lengths = lengths;
+    return true;
+}
+
+// Every byte has a code and the codes fill the code space.
+bool huffman::complete_code(std::array<uint8_t, 256> const& lengths)
+{
+    uint64_t kraft = 0;
+    for (auto len : lengths)
+    {
+        if (len == 0 || len > max_code_bits)
+            return false;
+        kraft += uint64_t(1) << (max_code_bits - len);
+    }
+    return kraft == uint64_t(1) << max_code_bits;
+}
+
+size_t huffman::encode_bound(size_t size, dictionary const& dict)
+{
+    return shared_bound(size, *std::max_element(dict.lengths.begin(), dict.lengths.end()));
+}
+
+size_t huffman::shared_bound(size_t size, uint8_t max_len)
+{
+    return sizeof(magic) + 1 + 5 + (uint64_t(size) * max_len + 7) / 8 + 8;
+}
+
+bool huffman::add_dictionary(workspace& work, dictionary const& dict)
+{
+    std::unique_ptr<shared_table> shared(new shared_table());
+    if (!complete_code(dict.lengths) || !canonical_table(dict.lengths, shared->table))
+        return false;
+    canonical_codes(dict.lengths, shared->codes);
+    shared->id = dict.id;
+    shared->max_len = shared->table.max_len;
+    shared->longest = *std::max_element(shared->codes.begin(), shared->codes.end(), [](code const& a, code const& b) {
+        return a.len < b.len;
+    });
+
+    for (auto& known : work.dictionaries)
+    {
+        if (known->id == dict.id)
+        {
+            known = std::move(shared);
+            return true;
+        }
+    }
+    work.dictionaries.push_back(std::move(shared));
+    return true;
+}
+
+bool huffman::encoder::add_dictionary(dictionary const& dict)
+{
+    return huffman::add_dictionary(*work, dict);
+}
+
+bool huffman::decoder::add_dictionary(dictionary const& dict)
+{
+    return huffman::add_dictionary(*work, dict);
+}
+
+// A stream coded with a dictionary: magic, version, varint dictionary id and
+// the bitstream, padded as finish_shared does. The table is known up front,
+// so it is coded in one pass.
+bool huffman::encoder::encode(std::istream& fin, std::ostream& fout, uint32_t dictionary_id)
+{
+    shared_table const* dict = work->find_dictionary(dictionary_id);
+    if (!dict)
+        return false;
+
+    char header[sizeof(magic) + 1 + 5];
+    char* h = std::copy(magic, magic + sizeof(magic), header);
+    *h++ = shared_version;
+    h = put_varint(h, dictionary_id);
+    fout.write(header, h - header);
+
+    char* buffer = work->in.get(buf_size);
+    bit_writer writer(&fout, work->out.get(buf_size), buf_size);
+    while (fin)
+    {
+        fin.read(buffer, buf_size * sizeof(char));
+        put_codes(buffer, size_t(fin.gcount()), dict->codes, writer);
+    }
+    finish_shared(writer, *dict);
+    return true;
+}
+
+size_t huffman::encoder::encode(const char* src, size_t size, char* dst, size_t capacity, uint32_t dictionary_id)
+{
+    shared_table const* dict = work->find_dictionary(dictionary_id);
+    if (!dict || capacity < shared_bound(size, dict->max_len))
+        return 0;
+
+    char* h = std::copy(magic, magic + sizeof(magic), dst);
+    *h++ = shared_version;
+    h = put_varint(h, dictionary_id);
+    bit_writer writer(nullptr, h, dst + capacity - h);
+    put_codes(src, size, dict->codes, writer);
+    finish_shared(writer, *dict);
+    return size_t(writer.out - dst);
+}
+
+// The stream has no padding count: the last byte is filled with the first
+// bits of the longest code instead. That code is at least 8 bits long, as
+// every byte has a code, so the padding never completes a symbol.
+void huffman::finish_shared(bit_writer& writer, shared_table const& dict)
+{
+    uint8_t pad = (8 - writer.count % 8) % 8;
+    writer.put(dict.longest.bits & ((uint64_t(1) << pad) - 1), pad);
+    writer.finish();
+}
+
+// Reads the id of a dictionary stream; null if no such dictionary was added.
+huffman::shared_table const* huffman::shared_header(const char*& p, const char* end, workspace& work)
+{
+    uint64_t id;
+    p += sizeof(magic) + 1;
+    if (!get_varint(p, end, id) || id > std::numeric_limits<uint32_t>::max())
+        return nullptr;
+    return work.find_dictionary(uint32_t(id));
+}
+
+// Each task takes every tasks-th block, so that it can keep one set of
+// decode tables for all of them.
+bool huffman::decode_parsed(const char* src, std::vector<block_ref> const& blocks, char* dst, workspace& work)
+{
+    thread_pool* pool = work.workers();
+    size_t tasks = pool ? std::min<size_t>(blocks.size(), work.opts.threads) : 1;
+    std::vector<block_tables>& tables = work.task_tables(tasks);
+    std::vector<char>& ok = work.ok;
+    ok.assign(blocks.size(), 1);
+    std::vector<decode_task>& running = work.decode_tasks;
+    running.resize(tasks);
+    for (size_t t = 0; t < tasks; t++)
+    {
+        running[t] = decode_task(blocks, src, dst, ok, tables[t], work, t, tasks);
+        if (pool)
+            pool->submit(running[t]);
+        else
+            running[t].run();
+    }
+    for (auto& r : running)
+        r.wait();
+
+    bool intact = true;
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        if (!ok[i])
+        {
+            std::fill_n(dst + blocks[i].offset, blocks[i].raw, 0);
+            intact = false;
+        }
+    }
+    return intact;
+}
+
+// Walks the headers of a framed stream held in memory; payload offsets are
+// relative to src. False unless the stream is complete up to its end block.
+bool huffman::parse_blocks(const char* src, size_t size, std::vector<block_ref>& blocks)
+{
+    const char* p = src;
+    const char* end = src + size;
+    uint64_t block_size;
+    if (size < sizeof(magic) + 1 || !std::equal(magic, magic + sizeof(magic), p) || p[sizeof(magic)] != block_version)
+        return false;
+    p += sizeof(magic) + 1;
+    if (!get_varint(p, end, block_size) || block_size == 0 || block_size > max_block_size || p == end
+            || (*p & ~flag_checksums) != 0)
+        return false;
+    bool checksums = *p++ & flag_checksums;
+
+    size_t offset = 0;
+    size_t table = 0;
+    size_t table_size = 0;
+    uint64_t table_id = 0;
+    while (p != end)
+    {
+        char type = *p++;
+        if (type == block_end)
+            return true;
+
+        uint64_t raw;
+        uint64_t payload_size;
+        uint32_t crc = 0;
+        if (!coded_block(type) || !get_varint(p, end, raw) || raw == 0 || raw > block_size
+                || !get_varint(p, end, payload_size) || payload_size > max_payload_size(raw)
+                || (checksums && end - p < 4))
+            return false;
+        if (checksums)
+        {
+            crc = uint32_t(load_le(p, 4));
+            p += 4;
+        }
+        if (payload_size > uint64_t(end - p))
+            return false;
+        if (type == block_huffman || type == block_interleaved)
+        {
+            table = size_t(p - src);
+            table_size = size_t(payload_size);
+            table_id++;
+        }
+        else if (type == block_repeat && !table_id)
+            return false;
+        if (type == block_huffman || type == block_interleaved || type == block_repeat)
+            blocks.push_back({type, size_t(p - src), size_t(payload_size), size_t(raw), offset, table, table_size,
+                              table_id, checksums, crc});
+        else
+            blocks.push_back({type, size_t(p - src), size_t(payload_size), size_t(raw), offset, 0, 0, 0, checksums,
+                              crc});
+        p += payload_size;
+        offset += raw;
+    }
+    return false;
+}
+
+// Reads up to `count` block headers and payloads; `more` turns false at the end
+// block. The last table sent is kept in the workspace, and copied once to the
+// end of b.in for repeat blocks that come before any table of this batch.
+template <class Batch>
+bool huffman::read_batch(std::istream& fin, Batch& b, uint64_t block_size, size_t count, bool& more,
+                         workspace& work)
+{
+    b.in.clear();
+    size_t offset = 0;
+    size_t table = 0;
+    size_t table_size = 0;
+    bool in_batch = false;
+    while (b.blocks.size() < count)
+    {
+        char type;
+        uint64_t size;
+        uint64_t payload_size;
+        if (!fin.get(type))
+            return false;
+        if (type == block_end)
+        {
+            more = false;
+            return true;
+        }
+        if (!coded_block(type) || !read_varint(fin, size) || size == 0
+                || size > block_size || !read_varint(fin, payload_size) || payload_size > max_payload_size(size))
+            return false;
+        char crc[4] = {};
+        if (work.checksums && !fin.read(crc, sizeof(crc)))
+            return false;
+
+        // The buffer grows with the bytes that arrive, so a header claiming
+        // more than the stream holds doesn't allocate it.
+        size_t payload = b.in.size();
+        for (uint64_t left = payload_size; left;)
+        {
+            size_t n = size_t(std::min<uint64_t>(left, buf_size));
+            size_t at = b.in.size();
+            b.in.resize(at + n);
+            fin.read(b.in.data() + at, n);
+            if (uint64_t(fin.gcount()) != n)
+                return false;
+            left -= n;
+        }
+
+        if (type == block_huffman || type == block_interleaved)
+        {
+            // A table that doesn't parse fails its block, and the blocks
+            // repeating it, when they are decoded.
+            const char* begin = b.in.data() + payload;
+            const char* p = begin;
+            std::array<uint8_t, 256> lengths;
+            if (!read_lengths(p, begin + payload_size, lengths))
+                p = begin;
+            work.last_table.assign(begin, p);
+            work.last_table_id++;
+            table = payload;
+            table_size = size_t(payload_size);
+            in_batch = true;
+        }
+        else if (type == block_repeat && !in_batch && work.last_table_id)
+        {
+            table = b.in.size();
+            table_size = work.last_table.size();
+            b.in.insert(b.in.end(), work.last_table.begin(), work.last_table.end());
+            in_batch = true;
+        }
+
+        uint32_t block_crc = uint32_t(load_le(crc, sizeof(crc)));
+        if (in_batch && (type == block_huffman || type == block_interleaved || type == block_repeat))
+            b.blocks.push_back({type, payload, size_t(payload_size), size_t(size), offset, table, table_size,
+                                work.last_table_id, work.checksums, block_crc});
+        else
+            b.blocks.push_back({type, payload, size_t(payload_size), size_t(size), offset, 0, 0, 0, work.checksums,
+                                block_crc});
+        offset += size;
+    }
+    return true;
+}
+
+// Bitstreams a block of `size` bytes is cut into.
+size_t huffman::block_streams(size_t size, options const& opts)
+{
+    size_t streams = std::min<size_t>(std::max(opts.streams, 1u), max_streams);
+    return size < streams * 64 ? 1 : streams;
+}
+
+// Counts a block and picks how it is coded before it is handed to a worker,
+// in block order: whichever of its own table, the last table sent, runs,
+// storing it, order-1 tables and a dictionary codes it smallest, so reusing
+// tables never costs bytes. Only a block coded with its own table makes that
+// the last table sent. The sizes compared are exact; the payloads other than
+// the runs' header are left to the worker.
+void huffman::plan_block(block_slot& slot, workspace& work)
+{
+    options const& opts = work.opts;
+    size_t size = slot.size;
+    size_t streams = block_streams(size, opts);
+    size_t segment = (size + streams - 1) / streams;
+    std::array<uint64_t, 256> freq = {};
+    size_t uniform = 0;
+    for (size_t s = 0; s < streams; s++)
+    {
+        size_t seg_begin = std::min(size, s * segment);
+        slot.seg_freq[s].fill(0);
+        uniform += histogram_runs(slot.data + seg_begin, std::min(size, (s + 1) * segment) - seg_begin,
+                                  slot.seg_freq[s]);
+        for (uint32_t i = 0; i != 256; ++i)
+            freq[i] += slot.seg_freq[s][i];
+    }
+    slot.planned = true;
+    if (freq[static_cast<unsigned char>(*slot.data)] == size)
+    {
+        slot.type = block_constant;
+        return;
+    }
+
+    char header[max_order0_header];
+    uint64_t total;
+    slot.lengths.fill(0);
+    code_lengths(freq, slot.lengths, opts.max_code_length, slot.merge);
+    char* h = order0_header(slot, streams, slot.lengths, false, header, total);
+    uint64_t best = uint64_t(h - header) + total;
+    slot.type = streams > 1 ? block_interleaved : block_huffman;
+    bool usable = work.table_sent;
+    for (uint32_t i = 0; i != 256; ++i)
+        usable = usable && (!freq[i] || work.table_lengths[i]);
+    if (usable)
+    {
+        h = order0_header(slot, streams, work.table_lengths, true, header, total);
+        uint64_t repeat = uint64_t(h - header) + total;
+        if (repeat <= best)
+        {
+            best = repeat;
+            slot.type = block_repeat;
+        }
+    }
+
+    // In the order encode_block tries them, each replacing the payload only
+    // where it is smaller.
+    size_t run_bytes = 128 * uniform >= size ? layout_runs(slot, freq, opts) : 0;
+    if (run_bytes && run_bytes < std::min<uint64_t>(best, size))
+    {
+        best = run_bytes;
+        slot.type = block_runs;
+    }
+    else if (best >= size)
+    {
+        best = size;
+        slot.type = block_stored;
+    }
+    size_t order1_bytes = opts.order1 && size >= min_order1_block ? layout_order1(slot.data, size, opts, slot) : 0;
+    if (order1_bytes && order1_bytes < best)
+    {
+        best = order1_bytes;
+        slot.type = block_order1;
+    }
+    uint64_t shared_bytes;
+    slot.dictionary = cheapest_shared(freq, best, work, shared_bytes);
+    if (slot.dictionary)
+        slot.type = block_shared;
+
+    if (slot.type == block_repeat)
+        slot.lengths = work.table_lengths;
+    else if (slot.type == block_huffman || slot.type == block_interleaved)
+    {
+        work.table_lengths = slot.lengths;
+        work.table_sent = true;
+    }
+}
+
+// Writes the header of an order-0 payload of a counted block, [lengths]
+// [stream count][varint sizes of all but the last stream], into `out` and
+// returns its end. A repeat block leaves out the lengths and always has the
+// stream count. `total` is set to the size of the streams.
+char* huffman::order0_header(block_slot const& slot, size_t streams, std::array<uint8_t, 256> const& lengths,
+                             bool repeat, char* out, uint64_t& total)
+{
+    auto const& seg_freq = slot.seg_freq;
+    std::array<uint64_t, max_streams> bytes = {};
+    total = 0;
+    for (size_t s = 0; s < streams; s++)
+    {
+        uint64_t bits = 0;
+        for (uint32_t i = 0; i != 256; ++i)
+            bits += seg_freq[s][i] * lengths[i];
+        bytes[s] = (bits + 7) / 8;
+        total += bytes[s];
+    }
+
+    char* h = repeat ? out : write_lengths(lengths, out);
+    if (streams > 1 || repeat)
+    {
+        *h++ = char(streams);
+        for (size_t s = 0; s + 1 < streams; s++)
+            h = put_varint(h, bytes[s]);
+    }
+    return h;
+}
+
+// Codes a block planned as anything but an order-0 payload.
+void huffman::code_planned(block_slot& slot)
+{
+    std::vector<char>& out = slot.payload;
+    if (slot.type == block_constant)
+        out.assign(slot.data, slot.data + 1);
+    else if (slot.type == block_stored)
+        out.assign(slot.data, slot.data + slot.size);
+    else
+    {
+        if (slot.type == block_runs)
+            code_runs(slot);
+        else if (slot.type == block_order1)
+            code_order1(slot.data, slot.size, slot);
+        else
+            code_shared(slot, *slot.dictionary);
+        out.swap(slot.alt);
+    }
+}
+
+// Codes one block into slot.payload and sets its type, unless plan_block
+// has chosen it. With several streams the block is cut into that many
+// contiguous segments, each with its own bitstream, and the payload is the
+// header from order0_header and the streams; a stored block is the bytes
+// themselves and a constant block its one byte value. Blocks where the
+// 16-byte steps of the histogram found runs covering an eighth of the block
+// are also tried as runs. The order-1 and dictionary payloads replace the
+// result where they are smaller.
+void huffman::encode_block(block_slot& slot, workspace const& work)
+{
+    options const& opts = work.opts;
+    const char* src = slot.data;
+    size_t size = slot.size;
+    std::vector<char>& out = slot.payload;
+    size_t streams = block_streams(size, opts);
+    size_t segment = (size + streams - 1) / streams;
+
+    // plan_block has counted a planned block.
+    auto& seg_freq = slot.seg_freq;
+    std::array<uint64_t, 256> freq = {};
+    size_t uniform = 0;
+    for (size_t s = 0; s < streams; s++)
+    {
+        size_t seg_begin = std::min(size, s * segment);
+        if (!slot.planned)
+        {
+            seg_freq[s].fill(0);
+            uniform += histogram_runs(src + seg_begin, std::min(size, (s + 1) * segment) - seg_begin, seg_freq[s]);
+        }
+        for (uint32_t i = 0; i != 256; ++i)
+            freq[i] += seg_freq[s][i];
+    }
+    // Right behind the histogram, while the block is still in cache.
+    if (opts.checksums)
+        slot.crc = crc32c(src, size);
+
+    bool repeat = slot.planned && slot.type == block_repeat;
+    if (slot.planned && !repeat && slot.type != block_huffman && slot.type != block_interleaved)
+    {
+        code_planned(slot);
+        return;
+    }
+    if (!slot.planned && freq[static_cast<unsigned char>(*src)] == size)
+    {
+        out.assign(src, src + 1);
+        slot.type = block_constant;
+        return;
+    }
+
+    std::array<uint8_t, 256> lengths = {};
+    if (slot.planned)
+        lengths = slot.lengths;
+    else
+        code_lengths(freq, lengths, opts.max_code_length, slot.merge);
+
+    uint64_t total;
+    out.resize(max_order0_header);
+    size_t header = size_t(order0_header(slot, streams, lengths, repeat, out.data(), total) - out.data());
+    out.resize(max_order0_header + total + 16);
+    char* h = out.data() + header;
+
+    // The sizes above are exact, so a block that won't shrink, or that
+    // codes smaller as runs, is known before any of it is coded.
+    uint64_t coded = header + total;
+    if (!slot.planned && 128 * uniform >= size && encode_runs(slot, freq, std::min<uint64_t>(coded, size), opts))
+    {
+        out.swap(slot.alt);
+        slot.type = block_runs;
+        try_alternatives(slot, freq, work);
+        return;
+    }
+    if (!slot.planned && coded >= size)
+    {
+        out.assign(src, src + size);
+        slot.type = block_stored;
+        try_alternatives(slot, freq, work);
+        return;
+    }
+
+    std::array<code, 256> codes = {};
+    canonical_codes(lengths, codes);
+    // A writer may store up to 8 bytes past its stream; the next one overwrites them.
+    for (size_t s = 0; s < streams; s++)
+    {
+        bit_writer writer(nullptr, h, out.data() + out.size() - h);
+        const char* seg_end = src + std::min(size, (s + 1) * segment);
+        for (const char* c = src + s * segment; c < seg_end; c++)
+        {
+            code const& symb_code = codes[static_cast<unsigned char>(*c)];
+            writer.put(symb_code.bits, symb_code.len);
+        }
+        writer.finish();
+        h = writer.out;
+    }
+    out.resize(h - out.data());
+
+    if (slot.planned)
+        return;
+    slot.type = streams > 1 ? block_interleaved : block_huffman;
+    try_alternatives(slot, freq, work);
+}
+
+// Replaces the payload of a block with its order-1 or dictionary payload,
+// whichever is smaller than it.
+void huffman::try_alternatives(block_slot& slot, std::array<uint64_t, 256> const& freq, workspace const& work)
+{
+    options const& opts = work.opts;
+    const char* src = slot.data;
+    size_t size = slot.size;
+    std::vector<char>& out = slot.payload;
+    if (opts.order1 && size >= min_order1_block && encode_order1(src, size, out.size(), opts, slot))
+    {
+        out.swap(slot.alt);
+        slot.type = block_order1;
+    }
+    if (encode_shared(slot, freq, out.size(), work))
+    {
+        out.swap(slot.alt);
+        slot.type = block_shared;
+    }
+}
+
+// Runs of at least min_run equal bytes. One 8-byte compare per step finds
+// every run of 15 bytes or more, which is then extended both ways.
+void huffman::find_runs(const char* src, size_t size, std::vector<byte_run>& runs)
+{
+    const uint64_t ones = 0x0101010101010101;
+    runs.clear();
+    size_t last = 0;
+    size_t i = 0;
+    while (i + 8 <= size)
+    {
+        uint64_t word = load_le64(src + i);
+        if (word != (word & 0xff) * ones)
+        {
+            i += 8;
+            continue;
+        }
+        char symb = src[i];
+        size_t start = i;
+        while (start > last && src[start - 1] == symb)
+            start--;
+        size_t end = i + 8;
+        while (end + 8 <= size && load_le64(src + end) == word)
+            end += 8;
+        while (end < size && src[end] == symb)
+            end++;
+        if (end - start >= min_run)
+        {
+            runs.push_back({start, end - start, symb});
+            last = end;
+        }
+        i = end;
+    }
+}
+
+// Run-length payload: [literal lengths][varint run count][for each run:
+// varint literals before it, varint length - min_run, byte][bitstream of the
+// literals]. Lays it out in slot.alt up to the bitstream and returns its
+// size with the bitstream, or 0 if the block has no runs.
+size_t huffman::layout_runs(block_slot& slot, std::array<uint64_t, 256> const& freq, options const& opts)
+{
+    std::vector<byte_run>& runs = slot.runs;
+    find_runs(slot.data, slot.size, runs);
+    if (runs.empty())
+        return 0;
+
+    std::array<uint64_t, 256> literals = freq;
+    for (auto const& r : runs)
+        literals[static_cast<unsigned char>(r.symb)] -= r.length;
+    std::array<uint8_t, 256>& lengths = slot.run_lengths;
+    lengths.fill(0);
+    code_lengths(literals, lengths, opts.max_code_length, slot.merge);
+    uint64_t bits = 0;
+    for (uint32_t i = 0; i != 256; ++i)
+        bits += literals[i] * lengths[i];
+
+    std::vector<char>& out = slot.alt;
+    out.resize(max_header_size + 10 + 21 * runs.size() + (bits + 7) / 8 + 8);
+    char* h = put_varint(write_lengths(lengths, out.data()), runs.size());
+    size_t pos = 0;
+    for (auto const& r : runs)
+    {
+        h = put_varint(put_varint(h, r.start - pos), r.length - min_run);
+        *h++ = r.symb;
+        pos = r.start + r.length;
+    }
+    slot.run_header = h - out.data();
+    return slot.run_header + size_t((bits + 7) / 8);
+}
+
+// Codes the literals of a block laid out by layout_runs.
+void huffman::code_runs(block_slot& slot)
+{
+    std::vector<char>& out = slot.alt;
+    std::array<code, 256> codes = {};
+    canonical_codes(slot.run_lengths, codes);
+    bit_writer writer(nullptr, out.data() + slot.run_header, out.size() - slot.run_header);
+    size_t pos = 0;
+    for (auto const& r : slot.runs)
+    {
+        put_codes(slot.data + pos, r.start - pos, codes, writer);
+        pos = r.start + r.length;
+    }
+    put_codes(slot.data + pos, slot.size - pos, codes, writer);
+    writer.finish();
+    out.resize(writer.out - out.data());
+}
+
+// Codes the run-length payload into slot.alt if it beats `limit` bytes.
+bool huffman::encode_runs(block_slot& slot, std::array<uint64_t, 256> const& freq, size_t limit,
+                          options const& opts)
+{
+    size_t bytes = layout_runs(slot, freq, opts);
+    if (!bytes || bytes >= limit)
+        return false;
+    code_runs(slot);
+    return true;
+}
+
+// The literals are decoded into the end of the block, then moved down into
+// place between the runs; a run never reaches the literals still to move.
+bool huffman::decode_runs(const char* p, const char* end, char* dst, size_t raw, decode_table& table)
+{
+    std::array<uint8_t, 256> lengths = {};
+    uint64_t count;
+    if (!read_lengths(p, end, lengths) || !get_varint(p, end, count) || count > raw / min_run)
+        return false;
+
+    const char* runs = p;
+    uint64_t pos = 0;
+    uint64_t run_bytes = 0;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        uint64_t gap;
+        uint64_t length;
+        if (!get_varint(p, end, gap) || gap > raw - pos || !get_varint(p, end, length) || p == end
+                || raw - pos - gap < min_run || length > raw - pos - gap - min_run)
+            return false;
+        p++;
+        pos += gap + length + min_run;
+        run_bytes += length + min_run;
+    }
+
+    size_t literals = raw - size_t(run_bytes);
+    const char* lit = dst + raw - literals;
+    if (literals)
+    {
+        bit_reader reader(p, end);
+        if (!canonical_table(lengths, table) || !decode_stream(reader, table, dst + raw - literals, dst + raw))
+            return false;
+    }
+    else if (p != end)
+        return false;
+
+    char* out = dst;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        uint64_t gap;
+        uint64_t length;
+        get_varint(runs, end, gap);
+        get_varint(runs, end, length);
+        std::memmove(out, lit, gap);
+        out += gap;
+        lit += gap;
+        std::memset(out, *runs++, length + min_run);
+        out += length + min_run;
+    }
+    std::memmove(out, lit, dst + raw - lit);
+    return true;
+}
+
+// The dictionary added to the encoder that codes a block with histogram
+// `freq` in the fewest bytes, if that beats `limit`; null otherwise. The
+// sizes follow from the histogram alone.
+huffman::shared_table const* huffman::cheapest_shared(std::array<uint64_t, 256> const& freq, uint64_t limit,
+                                                      workspace const& work, uint64_t& best_size)
+{
+    shared_table const* best = nullptr;
+    best_size = limit;
+    for (auto const& dict : work.dictionaries)
+    {
+        uint64_t bits = 0;
+        for (uint32_t i = 0; i != 256; ++i)
+            bits += freq[i] * dict->codes[i].len;
+        char id[5];
+        uint64_t size = uint64_t(put_varint(id, dict->id) - id) + (bits + 7) / 8;
+        if (size < best_size)
+        {
+            best = dict.get();
+            best_size = size;
+        }
+    }
+    return best;
+}
+
+// Dictionary payload: [varint dictionary id][bitstream], coded into slot.alt.
+void huffman::code_shared(block_slot& slot, shared_table const& dict)
+{
+    std::vector<char>& out = slot.alt;
+    out.resize(5 + (uint64_t(slot.size) * dict.max_len + 7) / 8 + 8);
+    char* h = put_varint(out.data(), dict.id);
+    bit_writer writer(nullptr, h, out.data() + out.size() - h);
+    put_codes(slot.data, slot.size, dict.codes, writer);
+    writer.finish();
+    out.resize(writer.out - out.data());
+}
+
+// Codes the cheapest dictionary payload into slot.alt if it beats `limit` bytes.
+bool huffman::encode_shared(block_slot& slot, std::array<uint64_t, 256> const& freq, size_t limit,
+                            workspace const& work)
+{
+    uint64_t size;
+    shared_table const* dict = cheapest_shared(freq, limit, work, size);
+    if (!dict)
+        return false;
+    code_shared(slot, *dict);
+    return true;
+}
+
+// Order-1 payload: [cluster count k][cluster of each of the 256 previous-byte
+// contexts, in ceil(log2 k) bits][k lengths tables][bitstream]. Every byte is
+// coded with the table of its predecessor's cluster; the first byte of a
+// block counts as following a zero byte. Picks the clusters and their tables
+// and returns the size of the payload, or 0 if all contexts end up in one
+// cluster, which is just the order-0 block.
+size_t huffman::layout_order1(const char* src, size_t size, options const& opts, block_slot& slot)
+{
+    if (!slot.order1)
+        slot.order1.reset(new order1_scratch());
+    order1_scratch& scratch = *slot.order1;
+    auto& contexts = scratch.contexts;
+    for (auto& context : contexts)
+        context.fill(0);
+    unsigned char prev = 0;
+    for (const char* c = src; c != src + size; c++)
+    {
+        auto symb = static_cast<unsigned char>(*c);
+        contexts[prev][symb]++;
+        prev = symb;
+    }
+
+    auto& cluster = scratch.cluster;
+    size_t k = cluster_contexts(scratch, size, cluster);
+    if (k < 2)
+        return 0;
+
+    auto& freq = scratch.freq;
+    for (size_t j = 0; j < k; j++)
+        freq[j].fill(0);
+    for (uint32_t c = 0; c != 256; ++c)
+        for (uint32_t i = 0; i != 256; ++i)
+            freq[cluster[c]][i] += contexts[c][i];
+
+    auto& lengths = scratch.lengths;
+    auto& codes = scratch.codes;
+    uint64_t bits = 0;
+    char header[max_header_size];
+    size_t tables = 0;
+    for (size_t j = 0; j < k; j++)
+    {
+        code_lengths(freq[j], lengths[j], opts.max_code_length, slot.merge);
+        canonical_codes(lengths[j], codes[j]);
+        for (uint32_t i = 0; i != 256; ++i)
+            bits += freq[j][i] * lengths[j][i];
+        tables += size_t(write_lengths(lengths[j], header) - header);
+    }
+
+    uint8_t width = 1;
+    while (size_t(1) << width < k)
+        width++;
+    scratch.clusters = k;
+    scratch.width = width;
+    scratch.bytes = 1 + 32 * width + tables + size_t((bits + 7) / 8);
+    return scratch.bytes;
+}
+
+// Codes a block laid out by layout_order1 into slot.alt.
+void huffman::code_order1(const char* src, size_t size, block_slot& slot)
+{
+    order1_scratch const& scratch = *slot.order1;
+    auto const& cluster = scratch.cluster;
+    auto const& codes = scratch.codes;
+    std::vector<char>& out = slot.alt;
+    out.resize(scratch.bytes + 16);
+    char* h = out.data();
+    *h++ = char(scratch.clusters);
+    bit_writer map(nullptr, h, out.size() - 1);
+    for (uint32_t c = 0; c != 256; ++c)
+        map.put(cluster[c], scratch.width);
+    map.finish();
+    h = map.out;
+    for (size_t j = 0; j < scratch.clusters; j++)
+        h = write_lengths(scratch.lengths[j], h);
+
+    bit_writer writer(nullptr, h, out.data() + out.size() - h);
+    unsigned char prev = 0;
+    for (const char* c = src; c != src + size; c++)
+    {
+        auto symb = static_cast<unsigned char>(*c);
+        code const& symb_code = codes[cluster[prev]][symb];
+        writer.put(symb_code.bits, symb_code.len);
+        prev = symb;
+    }
+    writer.finish();
+    out.resize(writer.out - out.data());
+}
+
+// Codes the order-1 payload into slot.alt if it beats `limit` bytes.
+bool huffman::encode_order1(const char* src, size_t size, size_t limit, options const& opts, block_slot& slot)
+{
+    size_t bytes = layout_order1(src, size, opts, slot);
+    if (!bytes || bytes >= limit)
+        return false;
+    code_order1(src, size, slot);
+    return true;
+}
+
+// Groups the 256 contexts into at most max_clusters clusters. Each busy
+// context seeds a cluster of its own and the sparse ones start out merged
+// in cluster 0; a few rounds of moving every context to the cluster whose
+// statistics code it cheapest (k-means on estimated bits) then settle the
+// grouping. Returns the number of clusters left.
+size_t huffman::cluster_contexts(order1_scratch& scratch, size_t size, std::array<uint8_t, 256>& cluster)
+{
+    auto const& contexts = scratch.contexts;
+    std::array<uint64_t, 256> total = {};
+    std::array<uint8_t, 256> by_total;
+    for (uint32_t c = 0; c != 256; ++c)
+    {
+        by_total[c] = uint8_t(c);
+        for (uint32_t i = 0; i != 256; ++i)
+            total[c] += contexts[c][i];
+    }
+    std::sort(by_total.begin(), by_total.end(), [&](uint8_t a, uint8_t b) { return total[a] > total[b]; });
+
+    const uint64_t dense = std::max<uint64_t>(256, size / 512);
+    size_t k = 1;
+    cluster.fill(0);
+    for (uint8_t c : by_total)
+    {
+        if (total[c] < dense || k == max_clusters)
+            break;
+        cluster[c] = uint8_t(k++);
+    }
+
+    auto& freq = scratch.freq;
+    auto& cost = scratch.cost;
+    for (int round = 0; round < 3 && k > 1; round++)
+    {
+        for (size_t j = 0; j < k; j++)
+            freq[j].fill(0);
+        for (uint32_t c = 0; c != 256; ++c)
+            for (uint32_t i = 0; i != 256; ++i)
+                freq[cluster[c]][i] += contexts[c][i];
+
+        // Bits per symbol under each cluster's statistics, with every
+        // count raised by one so that no symbol is free or impossible.
+        for (size_t j = 0; j < k; j++)
+        {
+            uint64_t sum = 256;
+            for (uint32_t i = 0; i != 256; ++i)
+                sum += freq[j][i];
+            for (uint32_t i = 0; i != 256; ++i)
+                cost[j][i] = std::log2(float(sum)) - std::log2(float(freq[j][i] + 1));
+        }
+
+        for (uint32_t c = 0; c != 256; ++c)
+        {
+            if (!total[c])
+                continue;
+            float best = 0;
+            for (size_t j = 0; j < k; j++)
+            {
+                float bits = 0;
+                for (uint32_t i = 0; i != 256; ++i)
+                    bits += float(contexts[c][i]) * cost[j][i];
+                if (j == 0 || bits < best)
+                {
+                    best = bits;
+                    cluster[c] = uint8_t(j);
+                }
+            }
+        }
+
+        // Renumber the clusters that kept any context.
+        std::array<int, max_clusters> renumber;
+        renumber.fill(-1);
+        size_t used = 0;
+        for (uint32_t c = 0; c != 256; ++c)
+        {
+            if (total[c] && renumber[cluster[c]] < 0)
+                renumber[cluster[c]] = int(used++);
+        }
+        for (uint32_t c = 0; c != 256; ++c)
+            cluster[c] = total[c] ? uint8_t(renumber[cluster[c]]) : 0;
+        k = used;
+    }
+    return k;
+}
+
+// Same lookup kernel as decode_fast, but each lookup takes one symbol only,
+// since the next symbol's table depends on this one.
+bool huffman::decode_order1(const char* p, const char* end, char* dst, size_t raw,
+                            std::vector<decode_table>& tables)
 {
-    std::array<uint64_t, 256> freq_array = {};
+    if (p == end)
+        return false;
+    auto k = size_t(static_cast<unsigned char>(*p++));
+    if (k < 2 || k > max_clusters)
+        return false;
+    uint8_t width = 1;
+    while (size_t(1) << width < k)
+        width++;
+    if (size_t(end - p) < 32u * width)
+        return false;
 
-    char buffer[buf_size];
-    fout.write(&buffer[0], sizeof(char));
+    if (tables.size() < k)
+        tables.resize(k);
+    std::array<const decode_table*, 256> context;
+    for (uint32_t c = 0; c != 256; ++c)
+    {
+        uint32_t id = 0;
+        for (uint8_t b = 0; b < width; b++)
+        {
+            uint32_t bit = c * width + b;
+            id |= uint32_t((static_cast<unsigned char>(p[bit / 8]) >> (bit % 8)) & 1) << b;
+        }
+        if (id >= k)
+            return false;
+        context[c] = &tables[id];
+    }
+    p += 32 * width;
 
-    while (fin)
+    uint8_t max_len = 0;
+    for (size_t j = 0; j < k; j++)
     {
-        fin.read(buffer, buf_size * sizeof(char));
-        auto numb_of_symbs = size_t(fin.gcount());
-        for(size_t i = 0; i < numb_of_symbs; i++)
+        decode_table& table = tables[j];
+        std::array<uint8_t, 256> lengths = {};
+        if (!read_lengths(p, end, lengths) || !canonical_table(lengths, table))
+            return false;
+        max_len = std::max(max_len, table.max_len);
+    }
+
+    bit_reader reader(p, end);
+    const uint64_t mask = (uint64_t(1) << decode_table::lookup_bits) - 1;
+    const size_t margin = 16 + (max_len + 7) / 8;
+    char* out = dst;
+    char* out_end = dst + raw;
+    unsigned char prev = 0;
+    while (size_t(reader.end - reader.p) >= margin && out_end - out >= 4)
+    {
+        reader.refill();
+        for (int n = 0; n < 4; n++)
         {
-            freq_array[static_cast<unsigned char>(buffer[i])]++;
+            decode_table const& table = *context[prev];
+            uint32_t e = table.entries[reader.buf & mask];
+            if (!((e >> 24) & 3))
+            {
+                if (!decode_one(reader, table, *out))
+                    return false;
+                prev = static_cast<unsigned char>(*out++);
+                break;
+            }
+            *out++ = char(e);
+            prev = uint8_t(e);
+            reader.consume(uint8_t(e >> 26));
         }
     }
+    while (out != out_end)
+    {
+        if (!decode_one(reader, *context[prev], *out))
+            return false;
+        prev = static_cast<unsigned char>(*out++);
+    }
+    return reader.bits_left() >= 0 && reader.bits_left() < 8;
+}
 
-    std::map<char, uint64_t> freq;
-    freq['a'] = freq['b'] = 0;
+// Checks the block's decoded bytes against its CRC, if it has one. They were
+// just written, so they are read from cache.
+bool huffman::check_block(block_ref const& block, const char* out)
+{
+    return !block.checked || crc32c(out + block.offset, block.raw) == block.crc;
+}
 
-    for (uint32_t i = 0; i != 256; ++i)
+// Offsets in block are relative to `in` and `out`. The order-0 table is only
+// built when it isn't already the one the task's last block was decoded with.
+bool huffman::decode_block(block_ref const& block, const char* in, char* out, block_tables& tables,
+                           workspace const& work)
+{
+    char type = block.type;
+    const char* p = in + block.payload;
+    const char* end = p + block.payload_size;
+    char* dst = out + block.offset;
+    size_t raw = block.raw;
+    if (type == block_stored)
     {
-        uint64_t fr = freq_array[static_cast<unsigned char>(i)];
-        if (fr != 0)
-            freq[i] = fr;
+        if (block.payload_size != raw)
+            return false;
+        std::memcpy(dst, p, raw);
+        return true;
+    }
+    if (type == block_constant)
+    {
+        if (block.payload_size != 1)
+            return false;
+        std::memset(dst, *p, raw);
+        return true;
+    }
+    if (type == block_order1 || type == block_runs)
+    {
+        tables.table_id = 0;
+        if (type == block_order1)
+            return decode_order1(p, end, dst, raw, tables.tables);
+        if (tables.tables.empty())
+            tables.tables.resize(1);
+        return decode_runs(p, end, dst, raw, tables.tables[0]);
+    }
+    if (type == block_shared)
+    {
+        uint64_t id;
+        shared_table const* dict = nullptr;
+        if (!get_varint(p, end, id) || id > std::numeric_limits<uint32_t>::max()
+                || !(dict = work.find_dictionary(uint32_t(id))))
+            return false;
+        bit_reader reader(p, end);
+        return decode_stream(reader, dict->table, dst, dst + raw);
+    }
+    if (!block.table_id)
+        return false;
+    if (tables.tables.empty())
+        tables.tables.resize(1);
+    decode_table& table = tables.tables[0];
+    const char* t = in + block.table;
+    std::array<uint8_t, 256> lengths = {};
+    if (tables.table_id != block.table_id)
+    {
+        tables.table_id = 0;
+        if (!read_lengths(t, t + block.table_size, lengths) || !canonical_table(lengths, table))
+            return false;
+        tables.table_id = block.table_id;
     }
+    else if (type != block_repeat && !read_lengths(t, t + block.table_size, lengths))
+        return false;
+    if (type != block_repeat)
+        p = t;
 
+    if (type == block_huffman)
+    {
+        bit_reader reader(p, end);
+        return decode_stream(reader, table, dst, dst + raw);
+    }
 
-    auto numb_of_symb = static_cast<uint16_t >(freq.size());
-    fout.write(reinterpret_cast<const char *>(&numb_of_symb), sizeof(numb_of_symb));
-    for (const auto i: freq)
+    if (p == end)
+        return false;
+    auto streams = size_t(static_cast<unsigned char>(*p++));
+    if (streams < (type == block_repeat ? 1 : 2) || streams > max_streams)
+        return false;
+    if (streams == 1)
     {
-        char key = i.first;
-        uint64_t count = i.second;
-        fout.write(&key, sizeof(key));
-        fout.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        bit_reader reader(p, end);
+        return decode_stream(reader, table, dst, dst + raw);
     }
 
-    std::array<std::vector<bool>, 256> codes;
-    std::vector<bool> curr_code;
-    std::unique_ptr<Node> root = build_tree(freq);
-    gen_codes(*root, codes, curr_code);
+    std::array<bit_reader, max_streams> readers;
+    std::array<char*, max_streams> outs;
+    std::array<char*, max_streams> ends;
+    size_t segment = (raw + streams - 1) / streams;
+    std::array<uint64_t, max_streams> bytes = {};
+    for (size_t s = 0; s + 1 < streams; s++)
+    {
+        if (!get_varint(p, end, bytes[s]))
+            return false;
+    }
+    for (size_t s = 0; s < streams; s++)
+    {
+        if (s + 1 == streams)
+            bytes[s] = uint64_t(end - p);
+        else if (bytes[s] > uint64_t(end - p))
+            return false;
+        readers[s] = bit_reader(p, p + bytes[s]);
+        p += bytes[s];
+        outs[s] = dst + std::min(raw, s * segment);
+        ends[s] = dst + std::min(raw, (s + 1) * segment);
+    }
 
-    char actual_code = 0;
-    char bits_counter = 0;
-    char numb_of_bits = 8;
+    switch (streams)
+    {
+        case 2: return decode_lockstep<2>(readers.data(), table, outs.data(), ends.data());
+        case 3: return decode_lockstep<3>(readers.data(), table, outs.data(), ends.data());
+        case 4: return decode_lockstep<4>(readers.data(), table, outs.data(), ends.data());
+        case 5: return decode_lockstep<5>(readers.data(), table, outs.data(), ends.data());
+        case 6: return decode_lockstep<6>(readers.data(), table, outs.data(), ends.data());
+        case 7: return decode_lockstep<7>(readers.data(), table, outs.data(), ends.data());
+        default: return decode_lockstep<8>(readers.data(), table, outs.data(), ends.data());
+    }
+}
 
-    fin.clear();
-    fin.seekg(0, std::ios::beg);
+// Decodes exactly out_end - out symbols; the input must end with them.
+bool huffman::decode_stream(bit_reader& reader, decode_table const& table, char* out, char* out_end)
+{
+    if (!decode_fast(reader, table, out, out_end, 16 + (table.max_len + 7) / 8))
+        return false;
+    while (out != out_end)
+    {
+        if (!decode_one(reader, table, *out++))
+            return false;
+    }
+    return reader.bits_left() >= 0 && reader.bits_left() < 8;
+}
 
-    char buffer_out[buf_size];
-    size_t numb_of_codes = 0;
+// Runs N independent streams through the same table, one refill and four
+// lookups per stream per round, so that N lookup chains are in flight at
+// once. The wider margin leaves room for a second refill after an escape.
+template <size_t N>
+bool huffman::decode_lockstep(bit_reader* readers, decode_table const& table, char** outs, char* const* ends)
+{
+    const size_t margin = 32 + (table.max_len + 7) / 8;
+    const uint64_t mask = (uint64_t(1) << table.bits) - 1;
+    std::array<bit_reader, N> r;
+    std::array<char*, N> o;
+    std::copy(readers, readers + N, r.begin());
+    std::copy(outs, outs + N, o.begin());
 
-    while(fin)
+    while (true)
     {
-        fin.read(buffer, buf_size * sizeof(char));
-        auto numb_of_symbs = size_t(fin.gcount());
-        for(size_t i = 0; i < numb_of_symbs; i++)
+        bool room = true;
+        for (size_t s = 0; s < N; s++)
+            room &= size_t(r[s].end - r[s].p) >= margin && ends[s] - o[s] >= 8;
+        if (!room)
+            break;
+
+        for (size_t s = 0; s < N; s++)
+            r[s].refill();
+        for (int k = 0; k < 4; k++)
         {
-            std::vector<bool> const& symb_code = codes[static_cast<unsigned char>(buffer[i])];
-            for (const auto next : symb_code)
+            for (size_t s = 0; s < N; s++)
             {
-                actual_code |= (next << bits_counter++);
-                if (bits_counter == numb_of_bits)
+                uint32_t e = table.entries[r[s].buf & mask];
+                uint8_t count = (e >> 24) & 3;
+                if (!count)
                 {
-                    buffer_out[numb_of_codes++] = actual_code;
-                    if (numb_of_codes == buf_size)
-                    {
-                        fout.write(buffer_out, numb_of_codes * sizeof(char));
-                        numb_of_codes = 0;
-                    }
-                    actual_code = 0;
-                    bits_counter = 0;
+                    if (!decode_one(r[s], table, *o[s]++))
+                        return false;
+                    r[s].refill();
+                    continue;
                 }
+                o[s][0] = char(e);
+                o[s][1] = char(e >> 8);
+                o[s] += count;
+                r[s].consume(uint8_t(e >> 16));
             }
         }
-        fout.write(buffer_out, numb_of_codes * sizeof(char));
     }
 
-    if (bits_counter)
+    for (size_t s = 0; s < N; s++)
     {
-        bits_counter = numb_of_bits - bits_counter;
-        fout.write(&actual_code, sizeof(actual_code));
+        if (!decode_stream(r[s], table, o[s], ends[s]))
+            return false;
     }
-    fout.seekp(0);
-    fout.write(&bits_counter, sizeof(bits_counter));
+    return true;
 }
 
-bool huffman::decode(std::istream &fin, std::ostream &fout)
+// Header of the frequency-table format: padding bits, a symbol count and
+// (symbol, uint64 count) records rebuilt into the same tree as the encoder's.
+bool huffman::legacy_table(const char*& p, const char* end, decode_table& table, char& fake_zero)
 {
-    char fake_zero;
-    fin.read(&fake_zero, sizeof(fake_zero));
-
-    if (!fin)
+    if (end - p < 3)
         return false;
-    std::map<char, uint64_t> freq;
-    uint16_t numb_of_symb;
-    fin.read(reinterpret_cast<char *>(&numb_of_symb), sizeof(numb_of_symb));
+    fake_zero = *p++;
+    auto numb_of_symb = uint16_t(load_le(p, 2));
+    p += 2;
+
+    flat_tree tree;
+    std::array<bool, 256> seen = {};
     for(size_t i = 0; i < numb_of_symb; i++)
     {
-        char key;
-        uint64_t count;
-        fin.read(&key, sizeof(key));
-        if (!fin)
+        if (end - p < 9)
             return false;
-        fin.read(reinterpret_cast<char *>(&count), sizeof(count));
-        if (freq.find(key) != freq.end())
+        char key = *p++;
+        uint64_t count = load_le(p, 8);
+        p += 8;
+        if (seen[static_cast<unsigned char>(key)])
             return false;
-        freq[key] = count;
+        seen[static_cast<unsigned char>(key)] = true;
+        tree.leaves[tree.leaf_count++] = {count, key};
     }
+    if (tree.leaf_count < 2)
+        return false;
 
-    std::unique_ptr<Node> root = build_tree(freq);
+    build_tree(tree);
+    std::array<uint8_t, 256> lengths = {};
+    table.max_len = tree_lengths(tree, lengths);
+    flatten(tree, table);
+    build_decode_table(table);
+    return true;
+}
 
-    char buffer[buf_size];
-    char buffer_out[buf_size];
-    size_t ready_chars = 0;
-    char numb_of_bits = 8;
-    Node* node = root.get();
+// Decodes up to four lookups per refill while at least `margin` input bytes
+// are left and there is room for eight output bytes.
+bool huffman::decode_fast(bit_reader& reader, decode_table const& table, char*& out, char* out_end, size_t margin)
+{
+    const uint64_t mask = (uint64_t(1) << table.bits) - 1;
+    char* o = out;
 
-    while(fin)
+    while (size_t(reader.end - reader.p) >= margin && out_end - o >= 8)
     {
-        ready_chars = 0;
-        fin.read(buffer, buf_size * sizeof(char));
-        auto symb_count = size_t(fin.gcount());
-        if (symb_count == 0)
-            break;
-        for(size_t i = 0; i < symb_count - 1; i++)
+        reader.refill();
+        for (int k = 0; k < 4; k++)
         {
-            for(size_t j = 0; j < size_t(numb_of_bits); j++)
+            uint32_t e = table.entries[reader.buf & mask];
+            uint8_t count = (e >> 24) & 3;
+            if (!count)
             {
-                node = (buffer[i] >> j) & 1 ? node->right.get() : node->left.get();
-                if (!node)
+                out = o;
+                if (!decode_one(reader, table, *out))
                     return false;
-
-                if (node->single)
-                {
-                    buffer_out[ready_chars++] = node->symb;
-                    if (ready_chars == buf_size)
-                    {
-                        ready_chars = 0;
-                        fout.write(buffer_out, buf_size * sizeof(char));
-                    }
-                    node = root.get();
-                }
+                o = out + 1;
+                break;
             }
+            o[0] = char(e);
+            o[1] = char(e >> 8);
+            o += count;
+            reader.consume(uint8_t(e >> 16));
         }
-        fout.write(buffer_out, ready_chars * sizeof(char));
-        if (!fin)
-            numb_of_bits = numb_of_bits - fake_zero;
-        for(size_t j = 0; j < size_t(numb_of_bits); j++)
+    }
+
+    out = o;
+    return true;
+}
+
+bool huffman::decode_one(bit_reader& reader, decode_table const& table, char& symb)
+{
+    reader.refill_safe();
+    uint32_t e = table.entries[reader.buf & ((uint64_t(1) << table.bits) - 1)];
+    if ((e >> 24) & 3)
+    {
+        symb = char(e);
+        reader.consume(uint8_t(e >> 26));
+        return true;
+    }
+
+    auto node = uint16_t(e);
+    reader.consume(table.bits);
+    while (node != decode_table::invalid && !(node & decode_table::leaf))
+    {
+        if (!reader.count)
+            reader.refill_safe();
+        node = table.tree[node][reader.buf & 1];
+        reader.consume(1);
+    }
+    if (node == decode_table::invalid)
+        return false;
+
+    symb = char(node);
+    return true;
+}
+
+// Sorts the leaves by weight, ties by symbol as std::map<char> ordered them,
+// and merges with two queues: the leaves in order and the internal nodes in
+// creation order, which is also weight order (van Leeuwen). A leaf wins a
+// tie and the first node taken becomes the left child, which reproduces the
+// multimap construction the legacy format was written with.
+void huffman::build_tree(flat_tree& tree)
+{
+    flat_tree::symbol* leaves = tree.leaves.data();
+    std::sort(leaves, leaves + tree.leaf_count, [](flat_tree::symbol const& a, flat_tree::symbol const& b) {
+        return a.weight != b.weight ? a.weight < b.weight : a.symb < b.symb;
+    });
+
+    uint16_t next_leaf = 0;
+    uint16_t next_node = 0;
+    tree.count = 0;
+    auto take = [&](uint64_t& weight) -> uint16_t {
+        if (next_leaf < tree.leaf_count
+                && (next_node == tree.count || leaves[next_leaf].weight <= tree.weight[next_node]))
         {
-            node = (buffer[symb_count - 1] >> j) & 1 ? node->right.get() : node->left.get();
-            if (!node)
-                return false;
+            weight = leaves[next_leaf].weight;
+            return flat_tree::leaf | static_cast<unsigned char>(leaves[next_leaf++].symb);
+        }
+        weight = tree.weight[next_node];
+        return next_node++;
+    };
+
+    while (tree.leaf_count - next_leaf + tree.count - next_node > 1)
+    {
+        uint64_t wa;
+        uint64_t wb;
+        uint16_t a = take(wa);
+        uint16_t b = take(wb);
+        tree.child[tree.count] = {{a, b}};
+        tree.weight[tree.count] = wa + wb;
+        tree.count++;
+    }
+}
 
-            if (node->single)
+// Sets the depth of every leaf and returns the deepest. Parents come after
+// their children, so one pass from the root down sees each parent first.
+uint8_t huffman::tree_lengths(flat_tree const& tree, std::array<uint8_t, 256>& lengths)
+{
+    std::array<uint8_t, 255> depth;
+    uint8_t max_depth = 0;
+    depth[tree.count - 1] = 0;
+    for (int i = tree.count - 1; i >= 0; i--)
+    {
+        for (uint16_t c : tree.child[i])
+        {
+            if (c & flat_tree::leaf)
+            {
+                lengths[uint8_t(c)] = depth[i] + 1;
+                max_depth = std::max<uint8_t>(max_depth, depth[i] + 1);
+            }
+            else
             {
-                fout.write(&node->symb, sizeof(char));
-                node = root.get();
+                depth[c] = depth[i] + 1;
             }
         }
     }
+    return max_depth;
+}
 
-    return true;
+// Copies the tree into table.tree, which wants the root at node 0, by
+// numbering the nodes from the root down.
+void huffman::flatten(flat_tree const& tree, decode_table& table)
+{
+    uint16_t last = tree.count - 1;
+    for (uint16_t i = 0; i < tree.count; i++)
+    {
+        for (size_t c = 0; c < 2; c++)
+        {
+            uint16_t child = tree.child[i][c];
+            table.tree[last - i][c] = child & flat_tree::leaf ? decode_table::leaf | uint8_t(child) : last - child;
+        }
+    }
+}
+
+void huffman::build_decode_table(decode_table& table)
+{
+    table.bits = decode_table::lookup_bits;
+    fill_entries(table, 0, 0, 0);
+
+    // Pair every entry with the symbol that follows it when it fits in the lookup.
+    const uint32_t size = uint32_t(1) << table.bits;
+    std::array<uint32_t, 1 << decode_table::lookup_bits> singles;
+    std::copy(table.entries.begin(), table.entries.begin() + size, singles.begin());
+    for (uint32_t i = 0; i < size; i++)
+    {
+        uint32_t first = singles[i];
+        auto len = uint8_t(first >> 16);
+        if (!((first >> 24) & 3) || len >= table.bits)
+            continue;
+        uint32_t second = singles[i >> len];
+        auto len2 = uint8_t(second >> 16);
+        if (!((second >> 24) & 3) || len + len2 > table.bits)
+            continue;
+        table.entries[i] = (first & 0xff) | (second & 0xff) << 8 | uint32_t(len + len2) << 16
+                | uint32_t(len) << 26 | uint32_t(2) << 24;
+    }
+}
+
+void huffman::fill_entries(decode_table& table, uint16_t node, uint32_t bits, uint8_t depth)
+{
+    if (depth == table.bits)
+    {
+        table.entries[bits] = decode_table::escape(node);
+        return;
+    }
+
+    const uint32_t size = uint32_t(1) << table.bits;
+    for (uint32_t c = 0; c < 2; c++)
+    {
+        uint16_t child = table.tree[node][c];
+        uint32_t code = bits | c << depth;
+        auto len = uint8_t(depth + 1);
+        if (child == decode_table::invalid || child & decode_table::leaf)
+        {
+            uint32_t e = child == decode_table::invalid
+                    ? decode_table::escape(decode_table::invalid)
+                    : decode_table::single(uint8_t(child), len);
+            for (uint32_t i = code; i < size; i += uint32_t(1) << len)
+                table.entries[i] = e;
+        }
+        else
+        {
+            fill_entries(table, child, code, len);
+        }
+    }
 }
 
-void huffman::gen_codes(huffman::Node& v, std::array<std::vector<bool>, 256>& codes, std::vector<bool>& curr_code)
+// Huffman code lengths for the symbols with nonzero frequency, no longer
+// than `limit` bits (0 meaning max_code_bits).
+void huffman::code_lengths(std::array<uint64_t, 256> const& freq, std::array<uint8_t, 256>& lengths, uint8_t limit,
+                           merge_lists& merge)
 {
-    if (v.single)
+    flat_tree tree;
+    for (uint32_t i = 0; i != 256; ++i)
+    {
+        if (freq[i] != 0)
+            tree.leaves[tree.leaf_count++] = {freq[i], char(i)};
+    }
+
+    lengths.fill(0);
+    if (tree.leaf_count == 1)
     {
-        codes[static_cast<unsigned char>(v.symb)] = curr_code;
-        curr_code.pop_back();
+        lengths[static_cast<unsigned char>(tree.leaves[0].symb)] = 1;
+        return;
+    }
+    if (tree.leaf_count == 0)
         return;
+
+    uint8_t min_limit = 1;
+    while (size_t(1) << min_limit < tree.leaf_count)
+        min_limit++;
+    if (limit == 0 || limit > max_code_bits)
+        limit = max_code_bits;
+    limit = std::max(limit, min_limit);
+
+    build_tree(tree);
+    if (tree_lengths(tree, lengths) > limit)
+        package_merge(freq, lengths, limit, merge);
+}
+
+// Optimal lengths under a length limit. Each of the `limit` lists merges the
+// symbols with the pairs packaged from the list below; the cheapest 2n - 2
+// items of the last list then give every symbol one bit per list it is
+// selected in.
+void huffman::package_merge(std::array<uint64_t, 256> const& freq, std::array<uint8_t, 256>& lengths,
+                            uint8_t limit, merge_lists& merge)
+{
+    using item = merge_lists::item;
+    std::vector<item>& leaves = merge.leaves;
+    leaves.clear();
+    for (uint32_t i = 0; i != 256; ++i)
+    {
+        if (freq[i] != 0)
+            leaves.push_back({freq[i], int16_t(i), 0});
+    }
+    // Equal weights stay in symbol order, without the buffer of a stable sort.
+    std::sort(leaves.begin(), leaves.end(), [](item const& a, item const& b) {
+        return a.weight < b.weight || (a.weight == b.weight && a.symb < b.symb);
+    });
+
+    std::vector<std::vector<item>>& lists = merge.lists;
+    if (lists.size() < limit)
+        lists.resize(limit);
+    lists[0] = leaves;
+    for (uint8_t level = 1; level < limit; level++)
+    {
+        std::vector<item> const& below = lists[level - 1];
+        std::vector<item>& list = lists[level];
+        list.clear();
+        size_t l = 0;
+        size_t pkg = 0;
+        while (l < leaves.size() || pkg + 1 < below.size())
+        {
+            uint64_t pkg_weight = pkg + 1 < below.size()
+                    ? below[pkg].weight + below[pkg + 1].weight
+                    : std::numeric_limits<uint64_t>::max();
+            if (l < leaves.size() && leaves[l].weight <= pkg_weight)
+            {
+                list.push_back(leaves[l++]);
+            }
+            else
+            {
+                list.push_back({pkg_weight, -1, uint16_t(pkg)});
+                pkg += 2;
+            }
+        }
+    }
+
+    lengths.fill(0);
+    std::vector<std::pair<uint8_t, uint16_t>>& stack = merge.stack;
+    stack.clear();
+    for (uint16_t i = 0; i < 2 * leaves.size() - 2; i++)
+        stack.emplace_back(limit - 1, i);
+    while (!stack.empty())
+    {
+        auto top = stack.back();
+        stack.pop_back();
+        item const& it = lists[top.first][top.second];
+        if (it.symb >= 0)
+        {
+            lengths[it.symb]++;
+        }
+        else
+        {
+            stack.emplace_back(top.first - 1, it.child);
+            stack.emplace_back(top.first - 1, it.child + 1);
+        }
+    }
+}
+
+// Canonical codes: shorter codes first, ties by symbol value. Stored bit
+// reversed so that they can be written LSB-first. Fails if the lengths
+// oversubscribe the code space.
+bool huffman::canonical_codes(std::array<uint8_t, 256> const& lengths, std::array<code, 256>& codes)
+{
+    std::array<uint32_t, max_code_bits + 1> count = {};
+    for (auto len : lengths)
+    {
+        if (len > max_code_bits)
+            return false;
+        count[len]++;
+    }
+    count[0] = 0;
+
+    std::array<uint64_t, max_code_bits + 2> next = {};
+    uint64_t kraft = 0;
+    for (uint8_t len = 1; len <= max_code_bits; len++)
+    {
+        next[len + 1] = (next[len] + count[len]) << 1;
+        kraft += uint64_t(count[len]) << (max_code_bits - len);
+    }
+    if (kraft > uint64_t(1) << max_code_bits)
+        return false;
+
+    for (uint32_t i = 0; i != 256; ++i)
+    {
+        uint8_t len = lengths[i];
+        codes[i] = {0, len};
+        if (!len)
+            continue;
+        uint64_t c = next[len]++;
+        for (uint8_t b = 0; b < len; b++)
+            codes[i].bits |= ((c >> b) & 1) << (len - 1 - b);
     }
+    return true;
+}
+
+// Inserts the canonical codes into table.tree. The code must be complete,
+// except that a single symbol gets the one-bit code 0.
+bool huffman::canonical_table(std::array<uint8_t, 256> const& lengths, decode_table& table)
+{
+    std::array<code, 256> codes = {};
+    if (!canonical_codes(lengths, codes))
+        return false;
 
-    curr_code.push_back(false);
-    gen_codes(*v.left, codes, curr_code);
-    curr_code.push_back(true);
-    gen_codes(*v.right, codes, curr_code);
+    uint64_t kraft = 0;
+    size_t used = 0;
+    for (auto len : lengths)
+    {
+        if (len)
+        {
+            kraft += uint64_t(1) << (max_code_bits - len);
+            used++;
+        }
+    }
+    if (used > 1 ? kraft != uint64_t(1) << max_code_bits : used == 1 && kraft != uint64_t(1) << (max_code_bits - 1))
+        return false;
 
-    if (!curr_code.empty())
-        curr_code.pop_back();
+    for (auto& node : table.tree)
+        node = {decode_table::invalid, decode_table::invalid};
+    table.max_len = 0;
+    uint16_t next = 1;
+    for (uint32_t i = 0; i != 256; ++i)
+    {
+        code c = codes[i];
+        if (!c.len)
+            continue;
+        uint16_t node = 0;
+        for (uint8_t d = 0; d + 1 < c.len; d++)
+        {
+            uint16_t& child = table.tree[node][(c.bits >> d) & 1];
+            if (child == decode_table::invalid)
+                child = next++;
+            node = child;
+        }
+        table.tree[node][(c.bits >> (c.len - 1)) & 1] = uint16_t(decode_table::leaf | i);
+        table.max_len = std::max(table.max_len, c.len);
+    }
+    build_decode_table(table);
+    return true;
 }
 
-std::unique_ptr<huffman::Node> huffman::build_tree(std::map<char, uint64_t> &freq)
+// Lengths of the coded symbols: a varint symbol count, the symbols themselves
+// (or a 256-bit set once that is shorter), the bit width of one length and the
+// lengths packed LSB-first at that width.
+char* huffman::write_lengths(std::array<uint8_t, 256> const& lengths, char* out)
 {
-    std::multimap<uint64_t, std::unique_ptr<Node>> nodes;
-    for(auto& i : freq)
+    uint32_t used = 0;
+    uint8_t max_len = 0;
+    for (auto len : lengths)
+    {
+        used += len != 0;
+        max_len = std::max(max_len, len);
+    }
+
+    out = put_varint(out, used);
+    if (!used)
+        return out;
+
+    if (used < 32)
+    {
+        for (uint32_t i = 0; i != 256; ++i)
+        {
+            if (lengths[i])
+                *out++ = char(i);
+        }
+    }
+    else
+    {
+        std::fill(out, out + 32, 0);
+        for (uint32_t i = 0; i != 256; ++i)
+        {
+            if (lengths[i])
+                out[i / 8] |= char(1 << (i % 8));
+        }
+        out += 32;
+    }
+
+    uint8_t width = 1;
+    while (max_len >> width)
+        width++;
+    *out++ = char(width);
+
+    uint32_t acc = 0;
+    uint8_t count = 0;
+    for (auto len : lengths)
     {
-        nodes.insert(std::make_pair(i.second, std::make_unique<Node>(i.first, i.second)));
+        if (!len)
+            continue;
+        acc |= uint32_t(len) << count;
+        count += width;
+        while (count >= 8)
+        {
+            *out++ = char(acc);
+            acc >>= 8;
+            count -= 8;
+        }
     }
+    if (count)
+        *out++ = char(acc);
+    return out;
+}
+
+bool huffman::read_lengths(const char*& p, const char* end, std::array<uint8_t, 256>& lengths)
+{
+    uint64_t used;
+    if (!get_varint(p, end, used) || used > 256)
+        return false;
+    lengths.fill(0);
+    if (!used)
+        return true;
 
-    while(nodes.size() > 1)
+    std::array<bool, 256> present = {};
+    if (used < 32)
+    {
+        if (uint64_t(end - p) < used)
+            return false;
+        for (uint64_t i = 0; i < used; i++)
+        {
+            auto symb = static_cast<unsigned char>(*p++);
+            if (present[symb])
+                return false;
+            present[symb] = true;
+        }
+    }
+    else
     {
-        std::unique_ptr<Node> a = std::move(nodes.begin()->second);
-        nodes.erase(nodes.begin());
-        std::unique_ptr<Node> b = std::move(nodes.begin()->second);
-        nodes.erase(nodes.begin());
+        if (end - p < 32)
+            return false;
+        uint64_t n = 0;
+        for (uint32_t i = 0; i != 256; ++i)
+        {
+            present[i] = (p[i / 8] >> (i % 8)) & 1;
+            n += present[i];
+        }
+        if (n != used)
+            return false;
+        p += 32;
+    }
 
-        uint64_t w = a->weight + b->weight;
-        nodes.insert(std::make_pair(w, std::make_unique<Node>('0', w, false, std::move(a), std::move(b))));
+    if (p == end)
+        return false;
+    auto width = uint8_t(*p++);
+    if (width == 0 || width > 8 || uint64_t(end - p) < (used * width + 7) / 8)
+        return false;
 
+    uint32_t acc = 0;
+    uint8_t count = 0;
+    for (uint32_t i = 0; i != 256; ++i)
+    {
+        if (!present[i])
+            continue;
+        if (count < width)
+        {
+            acc |= uint32_t(static_cast<unsigned char>(*p++)) << count;
+            count += 8;
+        }
+        lengths[i] = uint8_t(acc & ((1u << width) - 1));
+        if (!lengths[i])
+            return false;
+        acc >>= width;
+        count -= width;
     }
-    return std::move(nodes.begin()->second);
+    return true;
 }
\ No newline at end of file
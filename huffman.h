@@ -8,22 +8,312 @@
 #include <array>
 #include <vector>
 #include <iostream>
-#include <map>
 #include <memory>
 
 class huffman {
 public:
+    static const size_t default_block_size = 1 << 20;
+    static const size_t max_block_size = size_t(1) << 30;
+
+    struct options
+    {
+        // Longest code the encoder may produce, 0 for the format limit of 32 bits.
+        // Raised to what the number of distinct symbols needs.
+        uint8_t max_code_length = 0;
+        // Bytes per independently coded block of the framed format. 0 codes
+        // the whole input with a single table, which needs a seekable input.
+        size_t block_size = default_block_size;
+        // Threads coding or decoding blocks of the framed format concurrently,
+        // or counting the input of the single-table format; the output is the
+        // same for any thread count.
+        unsigned threads = 1;
+        // Independent bitstreams per block, decoded in lock-step by one
+        // thread to overlap their table lookups; at most 8.
+        unsigned streams = 1;
+        // One-pass adaptive Huffman (FGK): no table is sent and nothing is
+        // buffered, each byte's code is written as soon as the byte is read.
+        // The block options above don't apply.
+        bool adaptive = false;
+        // Also try coding each block of the framed format with tables chosen
+        // by the previous byte, keeping them where the block gets smaller.
+        bool order1 = false;
+        // Lets a block of the framed format reuse the last table sent when
+        // that codes it smaller than any other way, so the output never
+        // grows. Each block's coding is chosen in block order, so with
+        // several threads the counting, and with order1 the order-1 tables,
+        // are left to the caller's thread.
+        bool reuse_tables = false;
+        // Writes a CRC-32C of each block of the framed format, which decoding
+        // checks; a block that doesn't match is treated as corrupt.
+        bool checksums = false;
+    };
+
     static void encode(std::istream& fin, std::ostream& fout);
+    static void encode(std::istream& fin, std::ostream& fout, options const& opts);
     static bool decode(std::istream& fin, std::ostream& fout);
+    static bool decode(std::istream& fin, std::ostream& fout, options const& opts);
+
+    // Input already in memory, such as a mapped file, is coded in place.
+    static void encode(const char* src, size_t size, std::ostream& fout, options const& opts);
+    // Largest output of encode() into a buffer for `size` input bytes.
+    static size_t encode_bound(size_t size, options const& opts);
+    // Encodes into dst and returns the encoded size, or 0 if capacity is
+    // below encode_bound().
+    static size_t encode(const char* src, size_t size, char* dst, size_t capacity, options const& opts);
+    // Decoded size of a framed stream in memory, read from its block headers.
+    // False for the single-table formats, whose size is only known after
+    // decoding, and for a framed stream that is cut short.
+    static bool decoded_size(const char* src, size_t size, uint64_t& raw);
+    // Decodes into dst and sets `written`; false if src is corrupt or the
+    // output does not fit in capacity.
+    static bool decode(const char* src, size_t size, char* dst, size_t capacity, size_t& written,
+                       options const& opts);
+
+    // Adds the byte counts of [data, data + size) to freq.
+    static void histogram(const char* data, size_t size, std::array<uint64_t, 256>& freq);
+    // Same, counting slices of the input on several threads.
+    static void histogram(const char* data, size_t size, std::array<uint64_t, 256>& freq, unsigned threads);
+    // CRC-32C of [data, data + size), continuing from the CRC of the bytes
+    // before it. Uses the SSE 4.2 instruction where the CPU has it.
+    static uint32_t crc32c(const char* data, size_t size, uint32_t crc = 0);
+
+    // Code table trained on sample data and shared out of band: a stream
+    // coded with it carries the id instead of a table. Every byte value has
+    // a code, so it can code any input.
+    struct dictionary
+    {
+        uint32_t id = 0;
+        std::array<uint8_t, 256> lengths = {};
+    };
+
+    // Trains a dictionary on sample data, such as typical messages laid end
+    // to end. The id is a hash of the table, so equal tables get equal ids.
+    static dictionary train_dictionary(const char* samples, size_t size, options const& opts);
+    static void write_dictionary(dictionary const& dict, std::ostream& fout);
+    // Reads a dictionary written by write_dictionary, possibly reading past
+    // its end; false if it is not one or its lengths are not a complete code.
+    static bool read_dictionary(std::istream& fin, dictionary& dict);
+    // Largest output of encoder::encode() into a buffer with this dictionary.
+    static size_t encode_bound(size_t size, dictionary const& dict);
+
+    // Coder objects that keep their buffers, tables and threads between calls.
+    class encoder;
+    class decoder;
 
 private:
-    struct Node;
+    struct flat_tree;
+    struct bit_writer;
+    struct bit_reader;
+    struct decode_table;
+    struct stream_source;
+    struct memory_source;
+    struct memory_sink;
+    struct adaptive_tree;
+    struct adaptive_stream;
+    struct adaptive_memory;
+    struct order1_scratch;
+    struct block_slot;
+    struct decode_batch;
+    struct decode_task;
+    struct merge_lists;
+    struct workspace;
+    struct shared_table;
+    struct block_tables;
+    struct byte_run;
 
-    static void gen_codes(Node& v, std::array<std::vector<bool>, 256>& codes, std::vector<bool>& curr_code);
+    // Where a block's payload sits in the input read so far (or in the whole
+    // input, when it is in memory) and where its output goes.
+    struct block_ref
+    {
+        char type;
+        size_t payload;
+        size_t payload_size;
+        size_t raw;
+        size_t offset;
+        // Where the lengths of the block's order-0 table are, and the
+        // number of that table in the stream, from 1; 0 for other blocks.
+        size_t table;
+        size_t table_size;
+        uint64_t table_id;
+        // CRC-32C of the decoded block, if the stream has checksums.
+        bool checked;
+        uint32_t crc;
+    };
 
-    static std::unique_ptr<Node> build_tree(std::map<char, uint64_t>& freq);
+    struct code
+    {
+        uint64_t bits;
+        uint8_t len;
+    };
+
+    static void build_tree(flat_tree& tree);
+    static uint8_t tree_lengths(flat_tree const& tree, std::array<uint8_t, 256>& lengths);
+    static void flatten(flat_tree const& tree, decode_table& table);
+
+    static void code_lengths(std::array<uint64_t, 256> const& freq, std::array<uint8_t, 256>& lengths, uint8_t limit,
+                             merge_lists& merge);
+    static void package_merge(std::array<uint64_t, 256> const& freq, std::array<uint8_t, 256>& lengths,
+                              uint8_t limit, merge_lists& merge);
+    static bool canonical_codes(std::array<uint8_t, 256> const& lengths, std::array<code, 256>& codes);
+    static bool canonical_table(std::array<uint8_t, 256> const& lengths, decode_table& table);
+    static char* write_lengths(std::array<uint8_t, 256> const& lengths, char* out);
+    static bool read_lengths(const char*& p, const char* end, std::array<uint8_t, 256>& lengths);
+    static size_t histogram_runs(const char* data, size_t size, std::array<uint64_t, 256>& freq);
+    static void count_stream(std::istream& fin, std::array<uint64_t, 256>& freq, workspace& work);
+    static void count_memory(const char* data, size_t size, std::array<uint64_t, 256>& freq, workspace& work);
+    template <class Out>
+    static void write_single_header(std::array<uint64_t, 256> const& freq, workspace& work, Out& fout,
+                                    std::array<code, 256>& codes);
+    static void put_codes(const char* src, size_t size, std::array<code, 256> const& codes, bit_writer& writer);
+    static bool single_header(const char*& p, const char* end, decode_table& table, char& fake_zero);
+    static bool complete_code(std::array<uint8_t, 256> const& lengths);
+    static bool add_dictionary(workspace& work, dictionary const& dict);
+    static size_t shared_bound(size_t size, uint8_t max_len);
+    static shared_table const* shared_header(const char*& p, const char* end, workspace& work);
+    static void finish_shared(bit_writer& writer, shared_table const& dict);
+    static int tail_symbol(bit_reader& reader, decode_table const& table, char& symb, int fake_zero);
+    static void encode_adaptive(std::istream& fin, std::ostream& fout, workspace& work);
+    static void encode_adaptive(const char* src, size_t size, bit_writer& writer, workspace& work);
+    template <class IO>
+    static bool decode_adaptive(IO& io, adaptive_tree& tree);
+    template <class Source, class Out>
+    static void encode_blocks(Source& source, Out& fout, workspace& work);
+    static bool decode_blocks(std::istream& fin, std::ostream& fout, workspace& work);
+    static bool parse_blocks(const char* src, size_t size, std::vector<block_ref>& blocks);
+    static bool decode_parsed(const char* src, std::vector<block_ref> const& blocks, char* dst, workspace& work);
+    template <class Batch>
+    static bool read_batch(std::istream& fin, Batch& b, uint64_t block_size, size_t count, bool& more,
+                           workspace& work);
+    template <class Out>
+    static void write_block(Out& fout, block_slot const& slot, bool checksum);
+    static size_t block_streams(size_t size, options const& opts);
+    static void plan_block(block_slot& slot, workspace& work);
+    static char* order0_header(block_slot const& slot, size_t streams, std::array<uint8_t, 256> const& lengths,
+                               bool repeat, char* out, uint64_t& total);
+    static void code_planned(block_slot& slot);
+    static void encode_block(block_slot& slot, workspace const& work);
+    static void try_alternatives(block_slot& slot, std::array<uint64_t, 256> const& freq, workspace const& work);
+    static void find_runs(const char* src, size_t size, std::vector<byte_run>& runs);
+    static size_t layout_runs(block_slot& slot, std::array<uint64_t, 256> const& freq, options const& opts);
+    static void code_runs(block_slot& slot);
+    static bool encode_runs(block_slot& slot, std::array<uint64_t, 256> const& freq, size_t limit,
+                            options const& opts);
+    static bool decode_runs(const char* p, const char* end, char* dst, size_t raw, decode_table& table);
+    static shared_table const* cheapest_shared(std::array<uint64_t, 256> const& freq, uint64_t limit,
+                                               workspace const& work, uint64_t& best_size);
+    static void code_shared(block_slot& slot, shared_table const& dict);
+    static bool encode_shared(block_slot& slot, std::array<uint64_t, 256> const& freq, size_t limit,
+                              workspace const& work);
+    static bool decode_block(block_ref const& block, const char* in, char* out, block_tables& tables,
+                             workspace const& work);
+    static bool check_block(block_ref const& block, const char* out);
+    static size_t layout_order1(const char* src, size_t size, options const& opts, block_slot& slot);
+    static void code_order1(const char* src, size_t size, block_slot& slot);
+    static bool encode_order1(const char* src, size_t size, size_t limit, options const& opts, block_slot& slot);
+    static size_t cluster_contexts(order1_scratch& scratch, size_t size, std::array<uint8_t, 256>& cluster);
+    static bool decode_order1(const char* p, const char* end, char* dst, size_t raw,
+                              std::vector<decode_table>& tables);
+    static bool decode_stream(bit_reader& reader, decode_table const& table, char* out, char* out_end);
+    template <size_t N>
+    static bool decode_lockstep(bit_reader* readers, decode_table const& table, char** outs, char* const* ends);
+    static bool legacy_table(const char*& p, const char* end, decode_table& table, char& fake_zero);
+
+    static void build_decode_table(decode_table& table);
+    static void fill_entries(decode_table& table, uint16_t node, uint32_t bits, uint8_t depth);
+    static bool decode_fast(bit_reader& reader, decode_table const& table, char*& out, char* out_end, size_t margin);
+    static bool decode_one(bit_reader& reader, decode_table const& table, char& symb);
 
     static const uint32_t buf_size = 1024 * 512;
+    // Bytes each thread counts per batch of a parallel histogram.
+    static const size_t hist_slice = size_t(1) << 22;
+
+    static constexpr char magic[3] = {'H', 'U', 'F'};
+    static const char single_version = 1;
+    static const char block_version = 2;
+    static const char adaptive_version = 3;
+    static const char shared_version = 4;
+    static const char dictionary_version = 5;
+    static const char flag_checksums = 1;
+    static const char block_end = 0;
+    static const char block_huffman = 1;
+    static const char block_interleaved = 2;
+    static const char block_order1 = 3;
+    static const char block_shared = 4;
+    static const char block_repeat = 5;
+    static const char block_stored = 6;
+    static const char block_constant = 7;
+    static const char block_runs = 8;
+    static const size_t max_streams = 8;
+    static const size_t max_clusters = 16;
+    static const size_t min_order1_block = 4096;
+    // Shortest run a run-length block codes as a run.
+    static const size_t min_run = 32;
+
+    static bool coded_block(char type)
+    {
+        return type == block_huffman || type == block_interleaved || type == block_order1 || type == block_shared
+                || type == block_repeat || type == block_stored || type == block_constant || type == block_runs;
+    }
+    // No block codes to more than 8 bits a byte, since the encoder stores a
+    // block rather than let it grow, so a payload is at most the raw size
+    // plus tables, stream sizes and a padding byte per stream.
+    static uint64_t max_payload_size(uint64_t size)
+    {
+        return size + 1 + 128 + max_clusters * max_header_size + 11 * max_streams + 8;
+    }
+    static const uint8_t max_code_bits = 32;
+    static const size_t max_header_size = 256;
+    // Lengths, stream count and the varint sizes of all but the last stream.
+    static const size_t max_order0_header = max_header_size + 1 + 10 * max_streams;
+};
+
+// Keeps the buffers, tables, worker threads and their tasks, so that repeated
+// calls allocate nothing of their own once they have seen their largest input
+// and nothing large sits on the caller's stack. Codes one input at a time; the static
+// functions use a fresh one per call.
+class huffman::encoder
+{
+public:
+    explicit encoder(options const& opts = options());
+    ~encoder();
+    encoder(encoder&&) noexcept;
+    encoder& operator=(encoder&&) noexcept;
+
+    void encode(std::istream& fin, std::ostream& fout);
+    void encode(const char* src, size_t size, std::ostream& fout);
+    // Returns the encoded size, or 0 if capacity is below encode_bound().
+    size_t encode(const char* src, size_t size, char* dst, size_t capacity);
+
+    // False if the lengths are not a complete code. An added dictionary
+    // replaces one with the same id.
+    bool add_dictionary(dictionary const& dict);
+    // Codes in one pass with a dictionary added before, writing only its id
+    // in place of a table. False, having written nothing, for an unknown id.
+    bool encode(std::istream& fin, std::ostream& fout, uint32_t dictionary_id);
+    // Returns 0 for an unknown id or a capacity below encode_bound().
+    size_t encode(const char* src, size_t size, char* dst, size_t capacity, uint32_t dictionary_id);
+
+private:
+    std::unique_ptr<workspace> work;
+};
+
+class huffman::decoder
+{
+public:
+    explicit decoder(options const& opts = options());
+    ~decoder();
+    decoder(decoder&&) noexcept;
+    decoder& operator=(decoder&&) noexcept;
+
+    bool decode(std::istream& fin, std::ostream& fout);
+    bool decode(const char* src, size_t size, char* dst, size_t capacity, size_t& written);
+
+    // Lets decode() read streams coded with this dictionary; its decode
+    // table is built here, once. False if the lengths are not a complete code.
+    bool add_dictionary(dictionary const& dict);
+
+private:
+    std::unique_ptr<workspace> work;
 };
 
 
@@ -1,36 +1,189 @@
+#include <cstdlib>
 #include <fstream>
+#include "file_io.h"
 #include "huffman.h"
 
 void help() {
-    std::cout << "Please write: (-e | -d) source target" << std::endl;
+    std::cout << "Please write: (-e | -d) [-j threads] [-u] [-a] [-o] [-r] [-c] [-D dictionary] source target" << std::endl;
+    std::cout << "         or: -t samples dictionary" << std::endl;
+    std::cout << "Use - as source or target for standard input or output" << std::endl;
+    std::cout << "-u reads and writes files through an async queue (io_uring) instead of mapping them" << std::endl;
+    std::cout << "-a encodes in one adaptive pass, writing each byte's code as soon as it is read" << std::endl;
+    std::cout << "-o codes each block with tables chosen by the previous byte where that is smaller" << std::endl;
+    std::cout << "-r lets a block reuse the last table sent instead of its own where that is smaller" << std::endl;
+    std::cout << "-c writes a checksum of each block, checked when decoding" << std::endl;
+    std::cout << "-t trains a dictionary on sample data; -D codes with one, writing no table" << std::endl;
+    std::cout << "-D may be repeated: each block then takes whichever dictionary, or table of its own, is smallest" << std::endl;
     exit(0);
 }
 
+// Codes regular files through memory mappings. Returns false, having done
+// nothing, when the source can't be mapped or its decoded size isn't known
+// up front; the stream path handles those.
+bool run_mapped(std::string const& option, std::string const& source, std::string const& target,
+                huffman::options const& opts)
+{
+    mapped_file in;
+    if ((option != "-e" && option != "-d") || !in.open(source))
+        return false;
+
+    if (option == "-e")
+    {
+        std::ofstream out(target, std::ofstream::binary);
+        if (!out.is_open())
+            std::cerr << "File opening error" << std::endl;
+        else
+            huffman::encode(in.data(), in.size(), out, opts);
+        return true;
+    }
+
+    uint64_t raw;
+    size_t written;
+    if (!huffman::decoded_size(in.data(), in.size(), raw))
+        return false;
+    mapped_file out;
+    if (!out.create(target, size_t(raw)))
+        std::cerr << "File opening error" << std::endl;
+    else if (!huffman::decode(in.data(), in.size(), out.data(), out.size(), written, opts))
+        std::cerr << "File corrupted" << std::endl;
+    return true;
+}
+
+// Codes regular files through streams whose reads run ahead of the codec and
+// whose writes trail behind it. Returns false, having done nothing, when the
+// source isn't a regular file.
+bool run_async(std::string const& option, std::string const& source, std::string const& target,
+               huffman::options const& opts)
+{
+    async_input in;
+    if ((option != "-e" && option != "-d") || !in.open(source))
+        return false;
+    async_output out;
+    if (!out.open(target))
+    {
+        std::cerr << "File opening error" << std::endl;
+        return true;
+    }
+
+    std::istream istrm(&in);
+    std::ostream ostrm(&out);
+    bool decoded = true;
+    if (option == "-e")
+        huffman::encode(istrm, ostrm, opts);
+    else
+        decoded = huffman::decode(istrm, ostrm, opts);
+
+    if (in.failed())
+        std::cerr << "File reading error" << std::endl;
+    else if (!out.close())
+        std::cerr << "File writing error" << std::endl;
+    else if (!decoded)
+        std::cerr << "File corrupted" << std::endl;
+    return true;
+}
+
+// Trains a dictionary on the whole of source and writes it to target.
+void train(std::string const& source, std::string const& target, huffman::options const& opts)
+{
+    std::ifstream in(source, std::ifstream::binary);
+    std::ofstream out(target, std::ofstream::binary);
+    if (!in.is_open() || !out.is_open())
+    {
+        std::cerr << "File opening error" << std::endl;
+        return;
+    }
+    std::string samples((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    huffman::write_dictionary(huffman::train_dictionary(samples.data(), samples.size(), opts), out);
+}
+
 int main(int argc, char* argv[])
 {
-    if (argc != 4)
+    if (argc < 4)
     {
         help();
     }
     std::string option = std::string(argv[1]);
-    std::string source = argv[2];
-    std::string target = argv[3];
+    huffman::options opts;
+    bool async = false;
+    std::vector<std::string> dictionaries;
+    for (int i = 2; i < argc - 2; i++)
+    {
+        std::string flag = argv[i];
+        if (flag == "-j" && i + 1 < argc - 2 && std::atoi(argv[i + 1]) >= 1)
+            opts.threads = unsigned(std::atoi(argv[++i]));
+        else if (flag == "-u")
+            async = true;
+        else if (flag == "-a")
+            opts.adaptive = true;
+        else if (flag == "-o")
+            opts.order1 = true;
+        else if (flag == "-r")
+            opts.reuse_tables = true;
+        else if (flag == "-c")
+            opts.checksums = true;
+        else if (flag == "-D" && i + 1 < argc - 2)
+            dictionaries.push_back(argv[++i]);
+        else
+            help();
+    }
+    std::string source = argv[argc - 2];
+    std::string target = argv[argc - 1];
 
-    std::ifstream istrm(source, std::ifstream::binary);
-    std::ofstream ostrm(target, std::ofstream::binary);
-    if (!istrm.is_open() || !ostrm.is_open())
+    if (option == "-t")
     {
-        std::cout << "File opening error" << std::endl;
+        train(source, target, opts);
         return 0;
     }
 
-    if (option == "-e")
-        huffman::encode(istrm, ostrm);
+    huffman::encoder encoder(opts);
+    huffman::decoder decoder(opts);
+    huffman::dictionary dict;
+    for (auto const& name : dictionaries)
+    {
+        std::ifstream file(name, std::ifstream::binary);
+        if (!file.is_open())
+        {
+            std::cerr << "File opening error" << std::endl;
+            return 0;
+        }
+        if (!huffman::read_dictionary(file, dict))
+        {
+            std::cerr << "Dictionary corrupted" << std::endl;
+            return 0;
+        }
+        encoder.add_dictionary(dict);
+        decoder.add_dictionary(dict);
+    }
+
+    // Dictionaries live in the coder objects, so they take the stream path.
+    if (dictionaries.empty() && source != "-" && target != "-"
+            && (async ? run_async(option, source, target, opts) : run_mapped(option, source, target, opts)))
+        return 0;
+
+    std::ios_base::sync_with_stdio(false);
+    std::ifstream file_in;
+    std::istream& istrm = source == "-" ? std::cin : file_in;
+    if (source != "-")
+        file_in.open(source, std::ifstream::binary);
+    std::ofstream file_out;
+    std::ostream& ostrm = target == "-" ? std::cout : file_out;
+    if (target != "-")
+        file_out.open(target, std::ofstream::binary);
+    if ((source != "-" && !file_in.is_open()) || (target != "-" && !file_out.is_open()))
+    {
+        std::cerr << "File opening error" << std::endl;
+        return 0;
+    }
+
+    if (option == "-e" && dictionaries.size() == 1)
+        encoder.encode(istrm, ostrm, dict.id);
+    else if (option == "-e")
+        encoder.encode(istrm, ostrm);
     else if (option == "-d")
     {
-        if (!huffman::decode(istrm, ostrm))
+        if (!decoder.decode(istrm, ostrm))
         {
-            std::cout << "File corrupted" << std::endl;
+            std::cerr << "File corrupted" << std::endl;
             return 0;
         }
     } else {
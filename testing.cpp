@@ -2,9 +2,18 @@
 // Created by andry on 29.09.2018.
 //
 
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "gtest/gtest.h"
+#include "file_io.h"
 #include "huffman.h"
 
 
@@ -60,6 +69,33 @@ TEST(correctness, rand_big) {
     EXPECT_EQ(in.str(), d.str());
 }
 
+TEST(correctness, rand_stored) {
+    // Random blocks are stored; a compressible block between them is not.
+    std::string data;
+    for (int i = 0; i < 300000; i++) {
+        data += char(i / 100000 == 1 ? 'a' + rand() % 4 : rand() % 256);
+    }
+
+    for (unsigned streams : {1, 4}) {
+        huffman::options opts;
+        opts.block_size = 100000;
+        opts.streams = streams;
+        std::stringstream in(data);
+        std::stringstream c;
+        std::stringstream d;
+        huffman::encode(in, c, opts);
+        // Two blocks as they are and one at two bits a byte, plus headers.
+        EXPECT_LT(c.str().size(), 2 * 100000u + 100000u / 4 + 100);
+        EXPECT_EQ(true, huffman::decode(c, d, opts));
+        EXPECT_EQ(data, d.str());
+
+        std::string out(data.size(), '\0');
+        size_t written = 0;
+        EXPECT_EQ(true, huffman::decode(c.str().data(), c.str().size(), &out[0], out.size(), written, opts));
+        EXPECT_EQ(data, out);
+    }
+}
+
 TEST(correctness, invalid_file) {
     std::stringstream c;
     std::stringstream d("");
@@ -97,3 +133,1160 @@ TEST(correctness, similar_chars) {
     huffman::decode(c, d);
     EXPECT_EQ(in.str(), d.str());
 }
+
+TEST(correctness, constant_and_runs) {
+    // Zeroed pages between text, and a block of one byte value.
+    std::string text;
+    for (int i = 0; i < 3000; i++) {
+        text += "page " + std::to_string(rand() % 1000) + (i % 7 ? ", " : "\n");
+    }
+    std::string data;
+    std::string text_pages;
+    for (int page = 0; page < 64; page++) {
+        data += page % 4 == 1 ? text.substr(page * 100, 4096) : std::string(4096, '\0');
+        text_pages += page % 4 == 1 ? text.substr(page * 100, 4096) : std::string();
+    }
+    data += std::string(100000, 'x');
+    std::stringstream text_in(text_pages);
+    std::stringstream text_c;
+    huffman::encode(text_in, text_c);
+
+    std::string expected;
+    for (unsigned threads : {1, 3}) {
+        for (bool reuse : {false, true}) {
+            huffman::options opts;
+            opts.block_size = 64000;
+            opts.threads = threads;
+            opts.streams = 4;
+            opts.reuse_tables = reuse;
+            std::stringstream in(data);
+            std::stringstream c;
+            std::stringstream d;
+            huffman::encode(in, c, opts);
+            if (expected.empty()) {
+                expected = c.str();
+                // The zeros and the x's take a few bytes per run or block.
+                EXPECT_LT(c.str().size(), text_c.str().size() + 1000);
+            }
+            EXPECT_EQ(expected, c.str());
+            EXPECT_EQ(true, huffman::decode(c, d, opts));
+            EXPECT_EQ(data, d.str());
+
+            std::string out(data.size(), '\0');
+            size_t written = 0;
+            EXPECT_EQ(true, huffman::decode(c.str().data(), c.str().size(), &out[0], out.size(), written, opts));
+            EXPECT_EQ(data, out);
+        }
+    }
+}
+
+TEST(correctness, skewed_big) {
+    std::stringstream in;
+    std::stringstream c;
+    std::stringstream d;
+
+    for (int i = 0; i < int(3e6); i++) {
+        in << char('a' + (rand() % 16) * (rand() % 16) / 8);
+    }
+
+    huffman::encode(in, c);
+    huffman::decode(c, d);
+    EXPECT_EQ(in.str(), d.str());
+}
+
+TEST(correctness, deep_tree) {
+    std::stringstream in;
+    std::stringstream c;
+    std::stringstream d;
+
+    uint64_t a = 1, b = 1;
+    for (int s = 0; s < 30; s++) {
+        for (uint64_t i = 0; i < a; i++) {
+            in << char(s);
+        }
+        uint64_t t = a + b;
+        a = b;
+        b = t;
+    }
+
+    huffman::encode(in, c);
+    huffman::decode(c, d);
+    EXPECT_EQ(in.str(), d.str());
+}
+
+TEST(correctness, legacy_format) {
+    std::string legacy = {6, 2, 0};
+    legacy += 'a' + std::string("\1\0\0\0\0\0\0\0", 8);
+    legacy += 'b' + std::string("\1\0\0\0\0\0\0\0", 8);
+    legacy += '\2';
+    std::stringstream c(legacy);
+    std::stringstream d;
+
+    EXPECT_EQ(true, huffman::decode(c, d));
+    EXPECT_EQ("ab", d.str());
+}
+
+TEST(correctness, legacy_ties) {
+    // Written by the original encoder: many equal weights, and the padding
+    // 'a' and 'b' at weight zero, so every tie has to be broken the way the
+    // original tree construction broke it.
+    std::string legacy(
+        "\x05\x15\x00\x20\x01\x00\x00\x00\x00\x00\x00\x00\x2c\x01\x00\x00"
+        "\x00\x00\x00\x00\x00\x2e\x01\x00\x00\x00\x00\x00\x00\x00\x61\x00"
+        "\x00\x00\x00\x00\x00\x00\x00\x62\x00\x00\x00\x00\x00\x00\x00\x00"
+        "\x63\x03\x00\x00\x00\x00\x00\x00\x00\x64\x03\x00\x00\x00\x00\x00"
+        "\x00\x00\x65\x03\x00\x00\x00\x00\x00\x00\x00\x66\x03\x00\x00\x00"
+        "\x00\x00\x00\x00\x67\x03\x00\x00\x00\x00\x00\x00\x00\x68\x03\x00"
+        "\x00\x00\x00\x00\x00\x00\x69\x03\x00\x00\x00\x00\x00\x00\x00\x6a"
+        "\x03\x00\x00\x00\x00\x00\x00\x00\x6b\x02\x00\x00\x00\x00\x00\x00"
+        "\x00\x6c\x02\x00\x00\x00\x00\x00\x00\x00\x6d\x02\x00\x00\x00\x00"
+        "\x00\x00\x00\x6e\x02\x00\x00\x00\x00\x00\x00\x00\x6f\x01\x00\x00"
+        "\x00\x00\x00\x00\x00\x70\x01\x00\x00\x00\x00\x00\x00\x00\x71\x01"
+        "\x00\x00\x00\x00\x00\x00\x00\x7a\x08\x00\x00\x00\x00\x00\x00\x00"
+        "\xff\xff\xab\xaa\x99\xb9\x7b\x44\x64\x66\x55\x75\xf7\xcc\xac\xb5"
+        "\x37\x00\x22\xe3\x82\xc8\x3f\x05", 216);
+    std::stringstream c(legacy);
+    std::stringstream d;
+
+    EXPECT_EQ(true, huffman::decode(c, d));
+    EXPECT_EQ("zzzzzzcccdddeeefffggghhhiiijjjkkllmmnnopq, zz.", d.str());
+}
+
+TEST(format, small_header) {
+    std::stringstream in("abacaba");
+    std::stringstream c;
+    std::stringstream d;
+
+    huffman::encode(in, c);
+    EXPECT_LE(c.str().size(), 24u);
+    huffman::decode(c, d);
+    EXPECT_EQ(in.str(), d.str());
+}
+
+TEST(format, length_limit) {
+    std::string data;
+    uint64_t a = 1, b = 1;
+    for (int s = 0; s < 25; s++) {
+        data += std::string(a, char('a' + s));
+        uint64_t t = a + b;
+        a = b;
+        b = t;
+    }
+    // Shuffled, so that it isn't coded as runs.
+    for (size_t i = data.size() - 1; i > 0; i--) {
+        std::swap(data[i], data[rand() % (i + 1)]);
+    }
+
+    size_t unlimited = 0;
+    size_t limited = 0;
+    for (uint8_t limit : {0, 15, 12, 11, 5}) {
+        std::stringstream in(data);
+        std::stringstream c;
+        std::stringstream d;
+        huffman::options opts;
+        opts.max_code_length = limit;
+
+        huffman::encode(in, c, opts);
+        (limit ? limited : unlimited) = c.str().size();
+        EXPECT_EQ(true, huffman::decode(c, d));
+        EXPECT_EQ(data, d.str());
+    }
+    EXPECT_LT(unlimited, limited);
+}
+
+namespace {
+    // A string buffer that refuses to seek, like a pipe or a socket.
+    struct pipe_buf : std::stringbuf {
+        explicit pipe_buf(std::string const& s) : std::stringbuf(s) {}
+
+        pos_type seekoff(off_type, std::ios_base::seekdir, std::ios_base::openmode) override {
+            return pos_type(-1);
+        }
+
+        pos_type seekpos(pos_type, std::ios_base::openmode) override {
+            return pos_type(-1);
+        }
+    };
+}
+
+TEST(streaming, pipe_input) {
+    std::string data;
+    for (int i = 0; i < int(3e6); i++) {
+        data += char(i % 1000 < 500 ? 'a' + rand() % 4 : rand() % 256);
+    }
+    pipe_buf buf(data);
+    std::istream in(&buf);
+    std::stringstream c;
+    std::stringstream d;
+
+    huffman::encode(in, c);
+    EXPECT_EQ(true, huffman::decode(c, d));
+    EXPECT_EQ(data, d.str());
+}
+
+TEST(streaming, empty_pipe) {
+    pipe_buf buf("");
+    std::istream in(&buf);
+    std::stringstream c;
+    std::stringstream d;
+
+    huffman::encode(in, c);
+    EXPECT_EQ(true, huffman::decode(c, d));
+    EXPECT_EQ("", d.str());
+}
+
+TEST(streaming, pipe_output) {
+    std::stringstream in;
+    for (int i = 0; i < int(1e6); i++) {
+        in << char('a' + (rand() % 16) * (rand() % 16) / 8);
+    }
+    pipe_buf buf("");
+    std::ostream c(&buf);
+    std::stringstream d;
+
+    huffman::encode(in, c);
+    EXPECT_EQ(true, bool(c));
+    std::stringstream written(buf.str());
+    EXPECT_EQ(true, huffman::decode(written, d));
+    EXPECT_EQ(in.str(), d.str());
+}
+
+TEST(framed, block_sizes) {
+    std::string data;
+    for (int i = 0; i < 100000; i++) {
+        data += char(i < 50000 ? 'a' + rand() % 3 : rand() % 256);
+    }
+
+    for (size_t block_size : {0, 1, 1000, 65536, 1 << 20}) {
+        std::stringstream in(data);
+        std::stringstream c;
+        std::stringstream d;
+        huffman::options opts;
+        opts.block_size = block_size;
+
+        huffman::encode(in, c, opts);
+        EXPECT_EQ(true, huffman::decode(c, d));
+        EXPECT_EQ(data, d.str());
+    }
+}
+
+TEST(framed, corrupt_block) {
+    std::string data;
+    for (int i = 0; i < 30000; i++) {
+        data += char('a' + rand() % 20);
+    }
+    std::stringstream in(data);
+    std::stringstream c;
+    huffman::options opts;
+    opts.block_size = 10000;
+    huffman::encode(in, c, opts);
+
+    // Header is 7 bytes, then [type][raw size: 2][payload size: 2][payload].
+    // Damage the length width byte of the second block, which follows its
+    // 20 listed symbols.
+    std::string encoded = c.str();
+    auto size_at = [&](size_t i) {
+        return size_t(encoded[i] & 0x7f) | size_t(encoded[i + 1]) << 7;
+    };
+    size_t second = 7 + 5 + size_at(10);
+    ASSERT_EQ(1, encoded[second]);
+    ASSERT_EQ(10000u, size_at(second + 1));
+    encoded[second + 5 + 1 + 20] = char(0xff);
+    for (unsigned threads : {1, 4}) {
+        std::stringstream damaged(encoded);
+        std::stringstream d;
+        opts.threads = threads;
+
+        EXPECT_EQ(false, huffman::decode(damaged, d, opts));
+        ASSERT_EQ(data.size(), d.str().size());
+        EXPECT_EQ(data.substr(0, 10000), d.str().substr(0, 10000));
+        EXPECT_EQ(std::string(10000, '\0'), d.str().substr(10000, 10000));
+        EXPECT_EQ(data.substr(20000), d.str().substr(20000));
+    }
+}
+
+TEST(framed, thread_count_invariant) {
+    std::string data;
+    for (int i = 0; i < 500000; i++) {
+        data += char(i % 70000 < 30000 ? 'a' + rand() % 5 : rand() % 256);
+    }
+
+    std::string expected;
+    for (unsigned threads : {1, 2, 3, 8}) {
+        std::stringstream in(data);
+        std::stringstream c;
+        std::stringstream d;
+        huffman::options opts;
+        opts.block_size = 16384;
+        opts.threads = threads;
+
+        huffman::encode(in, c, opts);
+        if (threads == 1) {
+            expected = c.str();
+        }
+        EXPECT_EQ(expected, c.str());
+        EXPECT_EQ(true, huffman::decode(c, d, opts));
+        EXPECT_EQ(data, d.str());
+    }
+}
+
+TEST(framed, truncated) {
+    std::string data(200000, 'x');
+    for (size_t i = 0; i < data.size(); i += 7) {
+        data[i] = char(rand() % 256);
+    }
+    std::stringstream in(data);
+    std::stringstream c;
+    huffman::options opts;
+    opts.block_size = 50000;
+    huffman::encode(in, c, opts);
+
+    for (unsigned threads : {1, 2}) {
+        std::stringstream cut(c.str().substr(0, c.str().size() / 2));
+        std::stringstream d;
+        opts.threads = threads;
+        EXPECT_EQ(false, huffman::decode(cut, d, opts));
+    }
+}
+
+TEST(framed, oversized_payload_claim) {
+    // Headers claiming gigabyte payloads the stream doesn't have: one over
+    // the limit for its raw size, one within it.
+    for (std::string payload : {std::string("\x80\x80\x80\x80\x10"), std::string("\x80\x90\x80\x80\x04")}) {
+        std::string c = std::string("HUF\x02\x80\x80\x80\x80\x04", 9) + '\0' + '\x01'
+                + std::string("\x80\x80\x80\x80\x04") + payload + "abc";
+        std::stringstream in(c);
+        std::stringstream d;
+        EXPECT_EQ(false, huffman::decode(in, d));
+        std::vector<char> out(16);
+        size_t written = 0;
+        EXPECT_EQ(false, huffman::decode(c.data(), c.size(), out.data(), out.size(), written, huffman::options()));
+    }
+}
+
+TEST(framed, interleaved_streams) {
+    // Long codes on the tail exercise the escape path; the 300-byte last
+    // block is too small for 8 streams and falls back to one.
+    std::string data;
+    for (int i = 0; i < 100300; i++) {
+        int r = rand();
+        data += char(r % 4 ? 'a' + r % 3 : 'a' + __builtin_ctz(r | 0x100000) * 7);
+    }
+
+    for (unsigned streams : {1, 2, 3, 4, 8}) {
+        for (unsigned threads : {1, 3}) {
+            std::stringstream in(data);
+            std::stringstream c;
+            std::stringstream d;
+            huffman::options opts;
+            opts.block_size = 10000;
+            opts.streams = streams;
+            opts.threads = threads;
+            huffman::encode(in, c, opts);
+            EXPECT_EQ(true, huffman::decode(c, d, opts));
+            EXPECT_EQ(data, d.str());
+        }
+    }
+}
+
+TEST(framed, order1_contexts) {
+    // Each letter is mostly followed by one of two others, which an order-0
+    // table can't see; the 1000-byte last block is below the order-1 minimum.
+    std::string data;
+    char prev = 'a';
+    for (int i = 0; i < 121000; i++) {
+        int r = rand();
+        prev = char(r % 8 ? 'a' + (prev - 'a' + 1 + r % 2 * 5) % 20 : r % 64 + ' ');
+        data += prev;
+    }
+
+    std::string plain;
+    std::string order1_only;
+    for (bool order1 : {false, true}) {
+        for (bool reuse : {false, true}) {
+            for (unsigned threads : {1, 3}) {
+                std::stringstream in(data);
+                std::stringstream c;
+                std::stringstream d;
+                huffman::options opts;
+                opts.block_size = 30000;
+                opts.threads = threads;
+                opts.order1 = order1;
+                opts.reuse_tables = reuse;
+                huffman::encode(in, c, opts);
+                EXPECT_EQ(true, huffman::decode(c, d, opts));
+                EXPECT_EQ(data, d.str());
+                if (!order1 && !reuse) {
+                    plain = c.str();
+                } else if (order1 && !reuse) {
+                    order1_only = c.str();
+                    EXPECT_LT(c.str().size(), plain.size() * 3 / 4);
+                } else if (order1) {
+                    // Reusing tables never gives up an order-1 block.
+                    EXPECT_LE(c.str().size(), order1_only.size());
+                }
+            }
+        }
+    }
+}
+
+TEST(framed, repeated_tables) {
+    // Statistics that hold across the input, in blocks small enough for the
+    // table to be a large part of each; some blocks are runs of one letter.
+    std::string data;
+    for (int i = 0; i < 200000; i++) {
+        int r = rand();
+        data += i / 2048 % 7 == 3 ? 'q' : char(r % 4 ? 'a' + r % 6 : r % 90 + ' ');
+    }
+
+    for (unsigned streams : {1, 4}) {
+        std::string plain;
+        std::string expected;
+        for (bool reuse : {false, true}) {
+            for (unsigned threads : {1, 3}) {
+                huffman::options opts;
+                opts.block_size = 512;
+                opts.streams = streams;
+                opts.threads = threads;
+                opts.reuse_tables = reuse;
+                std::stringstream in(data);
+                std::stringstream c;
+                std::stringstream d;
+                huffman::encode(in, c, opts);
+                EXPECT_EQ(true, huffman::decode(c, d, opts));
+                EXPECT_EQ(data, d.str());
+
+                std::string out(data.size(), '\0');
+                size_t written = 0;
+                EXPECT_EQ(true, huffman::decode(c.str().data(), c.str().size(), &out[0], out.size(), written, opts));
+                EXPECT_EQ(data, out);
+                if (!reuse) {
+                    plain = c.str();
+                } else if (expected.empty()) {
+                    expected = c.str();
+                    EXPECT_LT(expected.size(), plain.size() * 19 / 20);
+                } else {
+                    EXPECT_EQ(expected, c.str());
+                }
+            }
+        }
+    }
+
+    // Runs too short to pay, so the middle block sends a table, which the
+    // last block may then repeat.
+    std::string words;
+    while (words.size() < 4096) {
+        words += std::string("lorem ipsum dolor sit amet ").substr(rand() % 6 * 4, 4 + rand() % 8);
+    }
+    words.resize(4096);
+    std::string runny;
+    while (runny.size() < 4096) {
+        runny += std::string(16, 'z');
+        for (int i = 0; i < 16; i++) {
+            runny += char('0' + rand() % 10);
+        }
+    }
+    runny.resize(4096);
+    data = words + runny + words;
+    for (unsigned threads : {1, 3}) {
+        huffman::options opts;
+        opts.block_size = 4096;
+        opts.threads = threads;
+        opts.reuse_tables = true;
+        std::stringstream in(data);
+        std::stringstream c;
+        std::stringstream d;
+        huffman::encode(in, c, opts);
+        EXPECT_EQ(true, huffman::decode(c, d, opts));
+        EXPECT_EQ(data, d.str());
+
+        std::string out(data.size(), '\0');
+        size_t written = 0;
+        EXPECT_EQ(true, huffman::decode(c.str().data(), c.str().size(), &out[0], out.size(), written, opts));
+        EXPECT_EQ(data, out);
+    }
+}
+
+TEST(histogram, matches_byte_loop) {
+    std::string data;
+    for (int i = 0; i < 100037; i++) {
+        data += char(i % 3000 < 1000 ? 'q' : rand() % 256);
+    }
+    for (size_t offset : {0, 1, 5}) {
+        for (size_t size : {0, 7, 16, 33, 100000}) {
+            std::array<uint64_t, 256> expected = {};
+            for (size_t i = offset; i < offset + size; i++) {
+                expected[static_cast<unsigned char>(data[i])]++;
+            }
+            std::array<uint64_t, 256> freq = {};
+            freq['z'] = 1;
+            expected['z']++;
+            huffman::histogram(data.data() + offset, size, freq);
+            EXPECT_EQ(expected, freq);
+        }
+    }
+}
+
+TEST(checksum, matches_bitwise_crc32c) {
+    EXPECT_EQ(0xe3069283u, huffman::crc32c("123456789", 9));
+
+    std::string data;
+    for (int i = 0; i < 20000; i++) {
+        data += char(rand() % 256);
+    }
+    for (size_t offset : {0, 3}) {
+        for (size_t size : {0, 5, 64, 6143, 6144, 19000}) {
+            uint32_t expected = ~0u;
+            for (size_t i = offset; i < offset + size; i++) {
+                expected ^= static_cast<unsigned char>(data[i]);
+                for (int bit = 0; bit < 8; bit++) {
+                    expected = expected >> 1 ^ (expected & 1 ? 0x82f63b78 : 0);
+                }
+            }
+            EXPECT_EQ(~expected, huffman::crc32c(data.data() + offset, size));
+            uint32_t first = huffman::crc32c(data.data() + offset, size / 3);
+            EXPECT_EQ(~expected, huffman::crc32c(data.data() + offset + size / 3, size - size / 3, first));
+        }
+    }
+}
+
+TEST(checksum, framed_corruption) {
+    // Random bytes are stored as they are, so a flipped bit still decodes
+    // unless the block's checksum catches it.
+    std::string data;
+    for (int i = 0; i < 50000; i++) {
+        data += i < 25000 ? char(rand() % 256) : char('a' + rand() % 3);
+    }
+
+    for (bool checksums : {false, true}) {
+        for (unsigned threads : {1, 3}) {
+            huffman::options opts;
+            opts.block_size = 5000;
+            opts.threads = threads;
+            opts.checksums = checksums;
+            std::stringstream in(data);
+            std::stringstream c;
+            std::stringstream d;
+            huffman::encode(in, c, opts);
+            EXPECT_EQ(true, huffman::decode(c, d, opts));
+            EXPECT_EQ(data, d.str());
+
+            std::string bad = c.str();
+            bad[bad.size() / 4] ^= 0x10;
+            std::stringstream bad_in(bad);
+            d.str("");
+            EXPECT_EQ(!checksums, huffman::decode(bad_in, d, opts));
+            EXPECT_EQ(data.size(), d.str().size());
+            std::string out(data.size(), '\0');
+            size_t written = 0;
+            EXPECT_EQ(!checksums, huffman::decode(bad.data(), bad.size(), &out[0], out.size(), written, opts));
+        }
+    }
+}
+
+TEST(histogram, parallel_single_table) {
+    std::string data(9 << 20, 'a');
+    for (size_t i = 0; i < data.size(); i += 3) {
+        data[i] = char(rand() % 256);
+    }
+
+    std::array<uint64_t, 256> expected = {};
+    huffman::histogram(data.data(), data.size(), expected);
+    std::array<uint64_t, 256> freq = {};
+    huffman::histogram(data.data(), data.size(), freq, 3);
+    EXPECT_EQ(expected, freq);
+
+    std::string single;
+    for (unsigned threads : {1, 2}) {
+        std::stringstream in(data);
+        std::stringstream c;
+        std::stringstream d;
+        huffman::options opts;
+        opts.block_size = 0;
+        opts.threads = threads;
+        huffman::encode(in, c, opts);
+        if (threads == 1) {
+            single = c.str();
+        }
+        EXPECT_EQ(single, c.str());
+        EXPECT_EQ(true, huffman::decode(c, d));
+        EXPECT_EQ(data, d.str());
+    }
+}
+
+TEST(memory, matches_streams) {
+    std::string data;
+    for (int i = 0; i < 300000; i++) {
+        data += char(i % 5000 < 2000 ? 'a' + rand() % 4 : rand() % 256);
+    }
+
+    for (size_t block_size : {size_t(0), size_t(65536)}) {
+        for (unsigned threads : {1, 3}) {
+            huffman::options opts;
+            opts.block_size = block_size;
+            opts.threads = threads;
+            std::stringstream in(data);
+            std::stringstream expected;
+            huffman::encode(in, expected, opts);
+            std::stringstream c;
+            huffman::encode(data.data(), data.size(), c, opts);
+            EXPECT_EQ(expected.str(), c.str());
+
+            std::string encoded = c.str();
+            uint64_t raw = 0;
+            EXPECT_EQ(block_size != 0, huffman::decoded_size(encoded.data(), encoded.size(), raw));
+            if (block_size) {
+                EXPECT_EQ(data.size(), raw);
+                std::string out(raw, '\0');
+                size_t written = 0;
+                EXPECT_EQ(true, huffman::decode(encoded.data(), encoded.size(), &out[0], out.size(), written, opts));
+                EXPECT_EQ(data.size(), written);
+                EXPECT_EQ(data, out);
+                EXPECT_EQ(false, huffman::decoded_size(encoded.data(), encoded.size() - 1, raw));
+            }
+        }
+    }
+}
+
+TEST(memory, buffer_round_trip) {
+    std::string random;
+    for (int i = 0; i < 200000; i++) {
+        random += char(rand() % 256);
+    }
+
+    for (size_t block_size : {size_t(0), size_t(1000), size_t(65536)}) {
+        for (unsigned streams : {1, 8}) {
+            huffman::options opts;
+            opts.block_size = block_size;
+            opts.streams = streams;
+            for (std::string const& data : {std::string(), std::string("a"), random}) {
+                std::vector<char> encoded(huffman::encode_bound(data.size(), opts));
+                size_t size = huffman::encode(data.data(), data.size(), encoded.data(), encoded.size(), opts);
+                EXPECT_NE(0u, size);
+                EXPECT_EQ(0u, huffman::encode(data.data(), data.size(), encoded.data(), encoded.size() - 1, opts));
+
+                std::stringstream in(data);
+                std::stringstream expected;
+                huffman::encode(in, expected, opts);
+                EXPECT_EQ(expected.str(), std::string(encoded.data(), size));
+
+                std::string out(data.size(), '\0');
+                size_t written = 0;
+                EXPECT_EQ(true, huffman::decode(encoded.data(), size, &out[0], out.size(), written, opts));
+                EXPECT_EQ(data.size(), written);
+                EXPECT_EQ(data, out);
+                if (!data.empty()) {
+                    EXPECT_EQ(false, huffman::decode(encoded.data(), size, &out[0], out.size() - 1, written, opts));
+                }
+            }
+        }
+    }
+}
+
+TEST(adaptive, round_trip) {
+    std::string skewed;
+    for (int i = 0; i < 300000; i++) {
+        skewed += char(i % 1000 < 700 ? 'a' + rand() % 3 : rand() % 256);
+    }
+    std::string all;
+    for (int i = 0; i < 512; i++) {
+        all += char(i);
+    }
+    huffman::options opts;
+    opts.adaptive = true;
+
+    for (std::string const& data : {std::string(), std::string("a"), std::string(1000, 'z'), all, skewed}) {
+        std::stringstream in(data);
+        std::stringstream c;
+        std::stringstream d;
+        huffman::encode(in, c, opts);
+        EXPECT_EQ(true, huffman::decode(c, d));
+        EXPECT_EQ(data, d.str());
+
+        std::vector<char> buffer(huffman::encode_bound(data.size(), opts));
+        size_t size = huffman::encode(data.data(), data.size(), buffer.data(), buffer.size(), opts);
+        EXPECT_EQ(c.str(), std::string(buffer.data(), size));
+        std::string out(data.size(), '\0');
+        size_t written = 0;
+        EXPECT_EQ(true, huffman::decode(buffer.data(), size, &out[0], out.size(), written, opts));
+        EXPECT_EQ(data, out.substr(0, written));
+
+        if (!data.empty()) {
+            std::stringstream cut(c.str().substr(0, c.str().size() - 1));
+            std::stringstream e;
+            EXPECT_EQ(false, huffman::decode(cut, e));
+        }
+    }
+}
+
+namespace {
+    // Hands out its input 100 bytes at a time and notes how much output
+    // there is whenever the reader comes back for more.
+    struct trickle_buf : std::streambuf {
+        trickle_buf(std::string const& s, std::stringstream& out) : data(s), out(out) {}
+
+        int_type underflow() override {
+            if (gptr() < egptr()) {
+                return traits_type::to_int_type(*gptr());
+            }
+            seen.push_back(out.str().size());
+            if (pos == data.size()) {
+                return traits_type::eof();
+            }
+            size_t n = std::min<size_t>(100, data.size() - pos);
+            setg(&data[pos], &data[pos], &data[pos] + n);
+            pos += n;
+            return traits_type::to_int_type(*gptr());
+        }
+
+        std::string data;
+        std::stringstream& out;
+        size_t pos = 0;
+        std::vector<size_t> seen;
+    };
+}
+
+TEST(adaptive, emits_before_reading_more) {
+    std::string data;
+    for (int i = 0; i < 5000; i++) {
+        data += char(rand() % 256);
+    }
+    std::stringstream c;
+    trickle_buf buf(data, c);
+    std::istream in(&buf);
+    huffman::options opts;
+    opts.adaptive = true;
+    huffman::encode(in, c, opts);
+
+    ASSERT_EQ(51u, buf.seen.size());
+    for (size_t i = 1; i < buf.seen.size(); i++) {
+        EXPECT_GT(buf.seen[i], buf.seen[i - 1]);
+    }
+}
+
+
+TEST(context, reuse_matches_static) {
+    // Inputs alternate between large and small so that the reused buffers
+    // and tables are always left over from a differently shaped call.
+    std::vector<std::string> inputs;
+    for (size_t size : {size_t(150000), size_t(0), size_t(900), size_t(70000), size_t(1)}) {
+        std::string data;
+        for (size_t i = 0; i < size; i++) {
+            data += char(i % 3000 < 1000 ? 'a' + rand() % 5 : rand() % 256);
+        }
+        inputs.push_back(data);
+    }
+
+    for (int mode = 0; mode < 4; mode++) {
+        huffman::options opts;
+        opts.block_size = mode == 0 ? 0 : 16384;
+        opts.threads = mode == 2 ? 3 : 1;
+        opts.order1 = mode == 2;
+        opts.adaptive = mode == 3;
+        huffman::encoder encoder(opts);
+        huffman::decoder decoder(opts);
+        for (int pass = 0; pass < 2; pass++) {
+            for (std::string const& data : inputs) {
+                std::stringstream in(data);
+                std::stringstream expected;
+                huffman::encode(in, expected, opts);
+
+                std::stringstream in2(data);
+                std::stringstream c;
+                encoder.encode(in2, c);
+                EXPECT_EQ(expected.str(), c.str());
+                std::vector<char> encoded(huffman::encode_bound(data.size(), opts));
+                size_t size = encoder.encode(data.data(), data.size(), encoded.data(), encoded.size());
+                EXPECT_EQ(expected.str(), std::string(encoded.data(), size));
+
+                std::stringstream d;
+                EXPECT_EQ(true, decoder.decode(c, d));
+                EXPECT_EQ(data, d.str());
+                std::string out(data.size(), '\0');
+                size_t written = 0;
+                EXPECT_EQ(true, decoder.decode(encoded.data(), size, &out[0], out.size(), written));
+                EXPECT_EQ(data, out.substr(0, written));
+            }
+        }
+    }
+}
+
+namespace
+{
+    std::atomic<size_t> allocations(0);
+}
+
+// Counts every allocation of the test binary. Kept out of line, where the
+// compiler can't pair the malloc and free inside them with new and delete.
+__attribute__((noinline)) void* operator new(size_t size) {
+    allocations++;
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+TEST(context, repeated_calls_allocate_nothing) {
+    // Skewed enough for a length limit of 9 to bind, so package-merge runs.
+    std::string data;
+    for (int i = 0; i < 200000; i++) {
+        int r = rand();
+        data += char(r % 2 ? 'a' : r % 4 == 1 ? 'b' : r % 256);
+    }
+
+    for (int mode = 0; mode < 5; mode++) {
+        huffman::options opts;
+        opts.block_size = mode == 0 ? 0 : 16384;
+        opts.threads = mode >= 2 ? 3 : 1;
+        opts.order1 = mode == 3;
+        opts.reuse_tables = mode == 4;
+        opts.max_code_length = 9;
+        huffman::encoder encoder(opts);
+        huffman::decoder decoder(opts);
+        std::vector<char> encoded(huffman::encode_bound(data.size(), opts));
+        std::string out(data.size(), '\0');
+        size_t before = 0;
+        for (int pass = 0; pass < 3; pass++) {
+            if (pass == 2) {
+                before = allocations;
+            }
+            size_t size = encoder.encode(data.data(), data.size(), encoded.data(), encoded.size());
+            size_t written = 0;
+            EXPECT_EQ(true, decoder.decode(encoded.data(), size, &out[0], out.size(), written));
+        }
+        EXPECT_EQ(before, size_t(allocations)) << "mode " << mode;
+        EXPECT_EQ(data, out);
+    }
+}
+
+namespace
+{
+    struct small_stack_job
+    {
+        std::string data;
+        huffman::options opts;
+        std::string result;
+    };
+
+    void* small_stack_round_trip(void* arg) {
+        auto& job = *static_cast<small_stack_job*>(arg);
+        huffman::encoder encoder(job.opts);
+        huffman::decoder decoder(job.opts);
+        std::stringstream in(job.data);
+        std::stringstream c;
+        std::stringstream d;
+        encoder.encode(in, c);
+        if (decoder.decode(c, d)) {
+            job.result = d.str();
+        }
+        return nullptr;
+    }
+}
+
+TEST(context, small_stack) {
+    std::string data;
+    for (int i = 0; i < 100000; i++) {
+        data += char(i % 2000 < 500 ? 'a' + rand() % 3 : rand() % 256);
+    }
+
+    for (int mode = 0; mode < 3; mode++) {
+        small_stack_job job;
+        job.data = data;
+        job.opts.block_size = mode == 0 ? 0 : 10000;
+        job.opts.order1 = mode == 1;
+        job.opts.adaptive = mode == 2;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, 64 * 1024);
+        pthread_t thread;
+        ASSERT_EQ(0, pthread_create(&thread, &attr, small_stack_round_trip, &job));
+        pthread_join(thread, nullptr);
+        pthread_attr_destroy(&attr);
+        EXPECT_EQ(data, job.result);
+    }
+}
+
+TEST(dictionary, small_messages) {
+    auto message = [](int n) {
+        std::string m = "{\"id\": " + std::to_string(n) + ", \"name\": \"user" + std::to_string(n * 7) + "\"}";
+        return m;
+    };
+    std::string samples;
+    for (int i = 0; i < 1000; i++) {
+        samples += message(i);
+    }
+
+    huffman::options opts;
+    huffman::dictionary trained = huffman::train_dictionary(samples.data(), samples.size(), opts);
+    std::stringstream file;
+    huffman::write_dictionary(trained, file);
+    huffman::dictionary dict;
+    ASSERT_EQ(true, huffman::read_dictionary(file, dict));
+    EXPECT_EQ(trained.id, dict.id);
+    EXPECT_EQ(trained.lengths, dict.lengths);
+    std::stringstream cut(file.str().substr(0, file.str().size() - 1));
+    EXPECT_EQ(false, huffman::read_dictionary(cut, dict));
+
+    huffman::encoder encoder(opts);
+    huffman::decoder decoder(opts);
+    ASSERT_EQ(true, encoder.add_dictionary(dict));
+    std::vector<std::string> messages = {std::string(), std::string("\xff"), message(123456), message(5) + "\x01\x80"};
+    for (std::string const& m : messages) {
+        std::vector<char> encoded(huffman::encode_bound(m.size(), dict));
+        size_t size = encoder.encode(m.data(), m.size(), encoded.data(), encoded.size(), dict.id);
+        ASSERT_NE(0u, size);
+        EXPECT_EQ(0u, encoder.encode(m.data(), m.size(), encoded.data(), encoded.size(), dict.id + 1));
+        if (m == message(123456)) {
+            std::vector<char> own(huffman::encode_bound(m.size(), opts));
+            EXPECT_LT(size, m.size());
+            // A table of its own costs more than the message, which is then stored.
+            EXPECT_LT(size, huffman::encode(m.data(), m.size(), own.data(), own.size(), opts));
+        }
+
+        std::stringstream in(m);
+        std::stringstream c;
+        EXPECT_EQ(true, encoder.encode(in, c, dict.id));
+        EXPECT_EQ(std::string(encoded.data(), size), c.str());
+
+        std::string out(m.size(), '\0');
+        size_t written = 0;
+        EXPECT_EQ(false, decoder.decode(encoded.data(), size, &out[0], out.size(), written));
+        ASSERT_EQ(true, decoder.add_dictionary(dict));
+        EXPECT_EQ(true, decoder.decode(encoded.data(), size, &out[0], out.size(), written));
+        EXPECT_EQ(m, out.substr(0, written));
+        std::stringstream d;
+        EXPECT_EQ(true, decoder.decode(c, d));
+        EXPECT_EQ(m, d.str());
+        decoder = huffman::decoder(opts);
+    }
+}
+
+TEST(dictionary, best_per_block) {
+    // Three shapes of data in alternating blocks, each with a dictionary
+    // trained on it; small blocks make a table of their own expensive.
+    auto shaped = [](int shape, size_t size) {
+        std::string data;
+        while (data.size() < size) {
+            int r = rand();
+            if (shape == 0) {
+                data += "{\"key\": " + std::to_string(r % 1000) + "}, ";
+            } else if (shape == 1) {
+                data += char(r % 16 ? r % 4 : r % 256);
+            } else {
+                data += "INFO request served in " + std::to_string(r % 90) + " ms\n";
+            }
+        }
+        data.resize(size);
+        return data;
+    };
+
+    huffman::options opts;
+    opts.block_size = 256;
+    std::vector<huffman::dictionary> dicts;
+    for (int shape = 0; shape < 3; shape++) {
+        std::string samples = shaped(shape, 50000);
+        dicts.push_back(huffman::train_dictionary(samples.data(), samples.size(), opts));
+    }
+    std::string data;
+    for (int block = 0; block < 120; block++) {
+        data += shaped(block % 3, opts.block_size);
+    }
+
+    std::stringstream plain_in(data);
+    std::stringstream plain;
+    huffman::encode(plain_in, plain, opts);
+
+    std::string expected;
+    for (unsigned threads : {1, 3}) {
+        opts.threads = threads;
+        huffman::encoder encoder(opts);
+        huffman::decoder decoder(opts);
+        for (auto const& dict : dicts) {
+            encoder.add_dictionary(dict);
+        }
+        std::stringstream in(data);
+        std::stringstream c;
+        encoder.encode(in, c);
+        if (expected.empty()) {
+            expected = c.str();
+        }
+        EXPECT_EQ(expected, c.str());
+        EXPECT_LT(c.str().size(), plain.str().size() * 9 / 10);
+
+        std::stringstream without(c.str());
+        std::stringstream d;
+        EXPECT_EQ(false, decoder.decode(without, d));
+        for (auto const& dict : dicts) {
+            decoder.add_dictionary(dict);
+        }
+        std::stringstream with(c.str());
+        d.str("");
+        EXPECT_EQ(true, decoder.decode(with, d));
+        EXPECT_EQ(data, d.str());
+
+        std::string out(data.size(), '\0');
+        size_t written = 0;
+        EXPECT_EQ(true, decoder.decode(c.str().data(), c.str().size(), &out[0], out.size(), written));
+        EXPECT_EQ(data, out);
+    }
+
+    // Reusing tables never gives up a dictionary block either.
+    opts.reuse_tables = true;
+    huffman::encoder encoder(opts);
+    huffman::decoder decoder(opts);
+    for (auto const& dict : dicts) {
+        encoder.add_dictionary(dict);
+        decoder.add_dictionary(dict);
+    }
+    std::stringstream in(data);
+    std::stringstream c;
+    std::stringstream d;
+    encoder.encode(in, c);
+    EXPECT_LE(c.str().size(), expected.size());
+    EXPECT_EQ(true, decoder.decode(c, d));
+    EXPECT_EQ(data, d.str());
+}
+
+namespace {
+    // A file in a fresh temporary directory, removed with it.
+    struct temp_file {
+        temp_file() {
+            char name[] = "/tmp/huffman_test_XXXXXX";
+            dir = mkdtemp(name) ? name : "";
+            path = dir + "/file";
+        }
+
+        ~temp_file() {
+            std::remove(path.c_str());
+            rmdir(dir.c_str());
+        }
+
+        void write(std::string const& data) const {
+            std::ofstream(path, std::ofstream::binary).write(data.data(), data.size());
+        }
+
+        std::string read() const {
+            std::ifstream in(path, std::ifstream::binary);
+            return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        }
+
+        std::string dir;
+        std::string path;
+    };
+
+    std::string random_text(size_t size) {
+        std::string data;
+        for (size_t i = 0; i < size; i++) {
+            data += char('a' + rand() % 26);
+        }
+        return data;
+    }
+}
+
+TEST(file_io, mapped_round_trip) {
+    temp_file file;
+    std::string data = random_text(10000);
+    {
+        mapped_file out;
+        ASSERT_EQ(true, out.create(file.path, data.size()));
+        std::copy(data.begin(), data.end(), out.data());
+    }
+    mapped_file in;
+    ASSERT_EQ(true, in.open(file.path));
+    EXPECT_EQ(data, std::string(in.data(), in.size()));
+
+    // An empty file can't be mapped, but can be created.
+    file.write("");
+    mapped_file empty;
+    EXPECT_EQ(false, empty.open(file.path));
+    mapped_file created;
+    EXPECT_EQ(true, created.create(file.path, 0));
+}
+
+TEST(file_io, queue_tags) {
+    temp_file file;
+    std::string data = random_text(3000);
+    file.write(data);
+    io_queue queue(2);
+    int fd = open(file.path.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+
+    char a[1000];
+    char b[1000];
+    queue.read(fd, a, sizeof(a), 0, 7);
+    queue.read(fd, b, sizeof(b), 2500, 9);
+    std::map<uint64_t, long> results;
+    for (int i = 0; i < 2; i++) {
+        uint64_t tag;
+        long result;
+        queue.wait(tag, result);
+        results[tag] = result;
+    }
+    EXPECT_EQ(1000, results[7]);
+    EXPECT_EQ(500, results[9]);
+    EXPECT_EQ(data.substr(0, 1000), std::string(a, 1000));
+    EXPECT_EQ(data.substr(2500), std::string(b, 500));
+
+    queue.write(fd, "xyz", 3, 10, 3);
+    uint64_t tag;
+    long result;
+    queue.wait(tag, result);
+    EXPECT_EQ(3u, tag);
+    EXPECT_EQ(3, result);
+    close(fd);
+    EXPECT_EQ("xyz", file.read().substr(10, 3));
+}
+
+TEST(file_io, async_input_chunks) {
+    // Sizes around multiples of the chunk, and past the read-ahead depth.
+    temp_file file;
+    for (size_t size : {0, 1, 999, 1000, 1001, 4500}) {
+        std::string data = random_text(size);
+        file.write(data);
+        async_input in(2, 1000);
+        ASSERT_EQ(true, in.open(file.path));
+        std::istream strm(&in);
+        std::string read((std::istreambuf_iterator<char>(strm)), std::istreambuf_iterator<char>());
+        EXPECT_EQ(data, read);
+        EXPECT_EQ(false, in.failed());
+    }
+    async_input missing(2, 1000);
+    EXPECT_EQ(false, missing.open(file.dir + "/missing"));
+}
+
+TEST(file_io, async_output_wraparound) {
+    // Many more chunks than the queue is deep, written in uneven pieces.
+    temp_file file;
+    for (size_t size : {0, 700, 10555}) {
+        std::string data = random_text(size);
+        async_output out(2, 1000);
+        ASSERT_EQ(true, out.open(file.path));
+        std::ostream strm(&out);
+        for (size_t i = 0; i < data.size(); i += 333) {
+            strm.write(data.data() + i, std::min<size_t>(333, data.size() - i));
+        }
+        EXPECT_EQ(true, out.close());
+        EXPECT_EQ(data, file.read());
+    }
+}
+
+TEST(file_io, async_output_errors) {
+    // Every write to /dev/full fails with ENOSPC.
+    if (access("/dev/full", W_OK) != 0) {
+        return;
+    }
+    async_output out(2, 1000);
+    ASSERT_EQ(true, out.open("/dev/full"));
+    std::ostream strm(&out);
+    std::string data = random_text(5000);
+    strm.write(data.data(), data.size());
+    EXPECT_EQ(false, out.close());
+}
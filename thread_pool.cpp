@@ -0,0 +1,84 @@
+#include <algorithm>
+#include "thread_pool.h"
+
+thread_pool::thread_pool(unsigned threads)
+{
+    for (unsigned i = 0; i < threads; i++)
+        workers.emplace_back(&thread_pool::work, this);
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+}
+
+void thread_pool::submit(task& t)
+{
+    t.pool = this;
+    t.ran = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (queued == queue.size())
+        {
+            std::vector<task*> grown(std::max<size_t>(8, 2 * queue.size()));
+            for (size_t i = 0; i < queued; i++)
+                grown[i] = queue[(head + i) % queue.size()];
+            queue.swap(grown);
+            head = 0;
+        }
+        queue[(head + queued) % queue.size()] = &t;
+        queued++;
+    }
+    ready.notify_one();
+}
+
+void thread_pool::work()
+{
+    while (true)
+    {
+        task* t;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.wait(lock, [this] { return stopping || queued; });
+            if (!queued)
+                return;
+            t = queue[head];
+            head = (head + 1) % queue.size();
+            queued--;
+        }
+        try
+        {
+            t->run();
+        }
+        catch (...)
+        {
+            t->error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            t->ran = true;
+        }
+        finished.notify_all();
+    }
+}
+
+void thread_pool::task::wait()
+{
+    if (!pool)
+        return;
+    {
+        std::unique_lock<std::mutex> lock(pool->mutex);
+        pool->finished.wait(lock, [this] { return ran; });
+    }
+    pool = nullptr;
+    std::exception_ptr thrown;
+    std::swap(thrown, error);
+    if (thrown)
+        std::rethrow_exception(thrown);
+}
@@ -0,0 +1,59 @@
+#ifndef HUFFMAN_V2_THREAD_POOL_H
+#define HUFFMAN_V2_THREAD_POOL_H
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running submitted tasks in FIFO order. Tasks
+// belong to the caller, which may submit one again once it has waited for
+// it, so that submitting allocates nothing once the queue has grown to the
+// most tasks ever pending.
+class thread_pool {
+public:
+    // Work for the pool; run() is called on a worker.
+    class task {
+    public:
+        virtual ~task() = default;
+
+        // Blocks until the task has run and rethrows what it threw; returns
+        // at once if it isn't pending.
+        void wait();
+
+    protected:
+        virtual void run() = 0;
+
+    private:
+        friend class thread_pool;
+
+        thread_pool* pool = nullptr;
+        bool ran = false;
+        std::exception_ptr error;
+    };
+
+    explicit thread_pool(unsigned threads);
+    ~thread_pool();
+
+    thread_pool(thread_pool const&) = delete;
+    thread_pool& operator=(thread_pool const&) = delete;
+
+    void submit(task& t);
+
+private:
+    void work();
+
+    std::vector<std::thread> workers;
+    // Ring of pending tasks from `head`, doubled when full.
+    std::vector<task*> queue;
+    size_t head = 0;
+    size_t queued = 0;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable finished;
+    bool stopping = false;
+};
+
+
+#endif //HUFFMAN_V2_THREAD_POOL_H